@@ -0,0 +1,110 @@
+// Measures the throughput of the grep filter (see setGrep) in MB/s.
+// The buffer is filled with lines none of the patterns matches, then handle()
+// is called until everything is processed. So with grep active the time is
+// spent scanning and skipping the lines (nothing is sent), without grep the
+// lines are sent to the client, which is the baseline. Connect a telnet
+// client, e.g.
+//     nc telnethost 23 > /dev/null
+// and the results are printed to the serial port.
+
+#include <Arduino.h>
+#include <TelnetSpy.h>
+
+#ifdef ESP8266
+#include <ESP8266WiFi.h>
+#else // ESP32
+#include <WiFi.h>
+#endif
+
+#if __has_include("./secrets.h")
+#include "secrets.h" // Include for AP_NAME and PASSWD below
+const char *ssid = AP_NAME;
+const char *password = PASSWRD;
+const int baud = BAUD;
+#else
+const char *ssid = "my_ap";
+const char *password = "passsword";
+const int baud = 115200;
+#endif
+
+#define BUFFER_SIZE 16000
+#define LINES 200	// per fill, must fit into the buffer
+#define LINE_LEN 72 // including the line break
+#define FILLS 10
+
+TelnetSpy SerialAndTelnet;
+
+// the patterns do not occur in the lines, so each line is scanned to its end
+const char *const patternSets[] = {
+    NULL, // no grep
+    "fatal",
+    "fatal|panic|abort",
+    "fatal|panic|abort|watchdog|overflow|brownout",
+};
+
+void fill()
+{
+    char line[LINE_LEN + 1];
+    for (uint16_t i = 0; i < LINES; i++)
+    {
+        int len = snprintf(line, sizeof(line), "[%6u][I][sensor.cpp:%3u] value ", i, i % 1000);
+        memset(&line[len], 'a' + (i % 26), LINE_LEN - 1 - len);
+        line[LINE_LEN - 1] = '\n';
+        SerialAndTelnet.write((const uint8_t *)line, LINE_LEN);
+    }
+}
+
+void runGrep(const char *patterns)
+{
+    SerialAndTelnet.setGrep(patterns);
+    uint32_t bytes = 0;
+    uint32_t time = 0;
+    for (uint8_t n = 0; n < FILLS; n++)
+    {
+        fill();
+        uint32_t start = micros();
+        while (SerialAndTelnet.getBufferPending() && SerialAndTelnet.isClientConnected())
+        {
+            SerialAndTelnet.handle();
+        }
+        time += micros() - start;
+        bytes += (uint32_t)LINES * LINE_LEN;
+    }
+    SerialAndTelnet.setGrep(NULL);
+    Serial.printf("%-46s %7lu bytes in %7lu us: %.2f MB/s\r\n", patterns ? patterns : "(no grep, lines sent)",
+                  (unsigned long)bytes, (unsigned long)time, time ? (float)bytes / time : 0.0f);
+}
+
+void setup()
+{
+    Serial.begin(baud);
+    SerialAndTelnet.setSerial(NULL); // the serial port would be the bottleneck
+    SerialAndTelnet.setWelcomeMsg("");
+    SerialAndTelnet.setBufferSize(BUFFER_SIZE);
+    SerialAndTelnet.begin(baud);
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(ssid, password);
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        delay(500);
+    }
+    Serial.print(F("\r\nConnect a telnet client to "));
+    Serial.println(WiFi.localIP());
+    while (!SerialAndTelnet.isClientConnected())
+    {
+        SerialAndTelnet.handle();
+        delay(10);
+    }
+    delay(500);
+    SerialAndTelnet.handle();
+    for (uint8_t i = 0; i < sizeof(patternSets) / sizeof(patternSets[0]); i++)
+    {
+        runGrep(patternSets[i]);
+    }
+    Serial.println(F("Done."));
+}
+
+void loop()
+{
+    SerialAndTelnet.handle();
+}
@@ -0,0 +1,105 @@
+// Measures the loop latency of the overflow policies (see setOverflowPolicy).
+// Each loop writes LINES_PER_LOOP lines of LINE_LEN bytes into a small buffer
+// and calls handle(). Connect a (slow) telnet client, e.g.
+//     nc telnethost 23 > log.txt
+// and the results are printed to the serial port. The number of lines the
+// client got per policy can be counted in log.txt (between the "---" lines).
+
+#include <Arduino.h>
+#include <TelnetSpy.h>
+
+#ifdef ESP8266
+#include <ESP8266WiFi.h>
+#else // ESP32
+#include <WiFi.h>
+#endif
+
+#if __has_include("./secrets.h")
+#include "secrets.h" // Include for AP_NAME and PASSWD below
+const char *ssid = AP_NAME;
+const char *password = PASSWRD;
+const int baud = BAUD;
+#else
+const char *ssid = "my_ap";
+const char *password = "passsword";
+const int baud = 115200;
+#endif
+
+#define BUFFER_SIZE 3000
+#define LINES_PER_LOOP 20
+#define LINE_LEN 72 // including the line break
+#define LOOPS 150
+
+TelnetSpy SerialAndTelnet;
+
+uint32_t loopTime[LOOPS];
+
+int compareTime(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+void runPolicy(TelnetSpy::overflowPolicy policy, const char *name)
+{
+    char line[LINE_LEN + 1];
+    SerialAndTelnet.setOverflowPolicy(policy);
+    SerialAndTelnet.printf("--- %s\n", name);
+    for (uint16_t i = 0; i < LOOPS; i++)
+    {
+        uint32_t start = micros();
+        for (uint8_t n = 0; n < LINES_PER_LOOP; n++)
+        {
+            int len = snprintf(line, sizeof(line), "%s %5u/%2u ", name, i, n);
+            memset(&line[len], 'x', LINE_LEN - 1 - len);
+            line[LINE_LEN - 1] = '\n';
+            SerialAndTelnet.write((const uint8_t *)line, LINE_LEN);
+        }
+        SerialAndTelnet.handle();
+        loopTime[i] = micros() - start;
+    }
+    // let the client get the rest before the next policy starts
+    uint32_t start = millis();
+    while (SerialAndTelnet.getBufferPending() && (millis() - start < 5000))
+    {
+        SerialAndTelnet.handle();
+        delay(1);
+    }
+    SerialAndTelnet.printf("---\n");
+    qsort(loopTime, LOOPS, sizeof(loopTime[0]), compareTime);
+    Serial.printf("%-13s median %lu us  max %lu us\r\n", name,
+                  (unsigned long)loopTime[LOOPS / 2], (unsigned long)loopTime[LOOPS - 1]);
+}
+
+void setup()
+{
+    Serial.begin(baud);
+    SerialAndTelnet.setSerial(NULL); // the serial port would be the bottleneck
+    SerialAndTelnet.setWelcomeMsg("");
+    SerialAndTelnet.setBufferSize(BUFFER_SIZE);
+    SerialAndTelnet.begin(baud);
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(ssid, password);
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        delay(500);
+    }
+    Serial.print(F("\r\nConnect a telnet client to "));
+    Serial.println(WiFi.localIP());
+    while (!SerialAndTelnet.isClientConnected())
+    {
+        SerialAndTelnet.handle();
+        delay(10);
+    }
+    delay(500);
+    runPolicy(TelnetSpy::OVERFLOW_DROP_OLDEST, "drop-oldest");
+    runPolicy(TelnetSpy::OVERFLOW_DROP_NEWEST, "drop-newest");
+    runPolicy(TelnetSpy::OVERFLOW_BLOCK, "block");
+    Serial.println(F("Done."));
+}
+
+void loop()
+{
+    SerialAndTelnet.handle();
+}
@@ -33,6 +33,9 @@ extern "C"
 #endif
 
 #include "TelnetSpy.h"
+#ifndef ESP8266
+#include "esp_log.h"
+#endif
 
 #ifndef min
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -41,15 +44,95 @@ extern "C"
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
-static TelnetSpy *actualObject = NULL;
+// System output is called from anywhere, even from interrupts and exception
+// handlers. So it is only put into a staging ring per source here, without
+// any lock, and moved to the buffer of the target instance by its handle().
+// A slot is reserved by incrementing "wrIdx" (only if the ring is not full),
+// zero marks a slot reserved but not written yet.
+struct TelnetSpyCapture
+{
+	TelnetSpy *target;
+	volatile uint32_t wrIdx;
+	volatile uint32_t rdIdx;
+	volatile uint32_t lost; // chars dropped because the ring was full
+	uint32_t lostReported;
+	volatile char buf[TELNETSPY_CAPTURE_LEN];
+};
+
+static TelnetSpyCapture captures[TELNETSPY_CAPTURE_SOURCES];
+
+static void IRAM_ATTR TelnetSpy_capture(uint8_t source, char c)
+{
+	TelnetSpyCapture &cap = captures[source];
+	if ((cap.target == NULL) || (c == 0))
+	{
+		return;
+	}
+#ifdef ESP8266
+	uint32_t savedPS = xt_rsil(15); // single core: only an interrupt could intervene
+	uint32_t idx = cap.wrIdx;
+	bool full = (idx - cap.rdIdx) >= TELNETSPY_CAPTURE_LEN;
+	if (full)
+	{
+		cap.lost++;
+	}
+	else
+	{
+		cap.wrIdx = idx + 1;
+	}
+	xt_wsr_ps(savedPS);
+	if (full)
+	{
+		return;
+	}
+#else
+	uint32_t idx = __atomic_load_n(&cap.wrIdx, __ATOMIC_RELAXED);
+	do
+	{
+		if ((idx - __atomic_load_n(&cap.rdIdx, __ATOMIC_ACQUIRE)) >= TELNETSPY_CAPTURE_LEN)
+		{
+			__atomic_fetch_add(&cap.lost, 1, __ATOMIC_RELAXED);
+			return; // full: the char is lost, the indices stay in step
+		}
+	} while (!__atomic_compare_exchange_n(&cap.wrIdx, &idx, idx + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+	cap.buf[idx & (TELNETSPY_CAPTURE_LEN - 1)] = c;
+}
+
+static void IRAM_ATTR TelnetSpy_putc(char c)
+{
+	if (NULL != captures[TelnetSpy::CAPTURE_OS_PRINT].target)
+	{
+		TelnetSpy_capture(TelnetSpy::CAPTURE_OS_PRINT, c);
+#ifdef ESP8266
+		ets_putc(c);
+#else
+		ets_write_char_uart(c);
+#endif
+	}
+}
+
+#ifndef ESP8266
+static vprintf_like_t TelnetSpy_prevVprintf = NULL;
 
-static void TelnetSpy_putc(char c)
+static int TelnetSpy_vprintf(const char *format, va_list args)
 {
-	if (NULL != actualObject)
+	char msg[TELNETSPY_CAPTURE_LOG_LINE];
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(msg, sizeof(msg), format, copy);
+	va_end(copy);
+	for (int i = 0; (i < len) && (i < (int)sizeof(msg) - 1); i++)
 	{
-		actualObject->debugWrite(c);
+		TelnetSpy_capture(TelnetSpy::CAPTURE_ESP_LOG, msg[i]);
 	}
+	if (TelnetSpy_prevVprintf)
+	{
+		return TelnetSpy_prevVprintf(format, args);
+	}
+	return len;
 }
+#endif
 
 static void TelnetSpy_ignore_putc(char c)
 {
@@ -60,6 +143,46 @@ static void TelnetSpy_ignore_putc(char c)
 #define TELNETSPY_SERIALPORT Serial
 #endif
 
+// Print sending directly to the telnet client (not via the transmit buffer)
+class TelnetSpyClientPrint : public Print
+{
+public:
+	TelnetSpyClientPrint(TelnetSpy *spy) : spy(spy) {}
+	size_t write(uint8_t c) override { return write(&c, 1); }
+	size_t write(const uint8_t *buffer, size_t size) override
+	{
+		spy->transmit(buffer, size);
+		return size;
+	}
+
+private:
+	TelnetSpy *spy;
+};
+
+#ifdef TELNETSPY_TRACE
+// Records "end" automatically, even if the traced function has several exits
+class TelnetSpyTraceScope
+{
+public:
+	TelnetSpyTraceScope(TelnetSpy *spy, uint8_t phase) : spy(spy), phase(phase) { spy->traceEvent(phase, true); }
+	~TelnetSpyTraceScope() { spy->traceEvent(phase, false); }
+
+private:
+	TelnetSpy *spy;
+	uint8_t phase;
+};
+
+static const char *const traceNames[] = {"handle", "sendBlock", "checkReceive", "connect", "evict"};
+
+#define TELNETSPY_TRACE_BEGIN(phase) traceEvent(phase, true);
+#define TELNETSPY_TRACE_END(phase) traceEvent(phase, false);
+#define TELNETSPY_TRACE_SCOPE(phase) TelnetSpyTraceScope traceScope(this, phase);
+#else
+#define TELNETSPY_TRACE_BEGIN(phase)
+#define TELNETSPY_TRACE_END(phase)
+#define TELNETSPY_TRACE_SCOPE(phase)
+#endif
+
 TelnetSpy::TelnetSpy()
 {
 	port = TELNETSPY_PORT;
@@ -75,6 +198,26 @@ TelnetSpy::TelnetSpy()
 #endif
 	storeOffline = true;
 	connected = false;
+	channelHost = NULL;
+	channels = NULL;
+	nextChannel = NULL;
+	channelId = 0;
+	activeChannel = 0;
+#ifdef TELNETSPY_WEBSOCKET
+	webSocket = false;
+	wsState = WS_OFF;
+	wsHeaders = 0;
+#endif
+#ifdef TELNETSPY_SYSLOG
+	syslogUdp = NULL;
+	syslogHeader = NULL;
+	syslogInterval = 1000 / TELNETSPY_SYSLOG_RATE;
+	syslogHoldoff = 0;
+	syslogLineHoldoff = 0;
+	syslogLineWait = false;
+	sysRdIdx = 0;
+	sysLeftToSend = 0;
+#endif
 	callbackConnect = NULL;
 	callbackDisconnect = NULL;
 	callbackNvtBRK = NULL;
@@ -90,6 +233,62 @@ TelnetSpy::TelnetSpy()
 	filterChar = 0;
 	filterMsg = NULL;
 	filterCallback = NULL;
+	cmdPrefix = TELNETSPY_CMD_PREFIX;
+	cmdLen = 0;
+	cmdState = 0;
+	recLineStart = true;
+	sinks = NULL;
+	bufWrCount = 0;
+	bufReserved = 0;
+	overflow = OVERFLOW_DROP_OLDEST;
+	overflowTimeout = TELNETSPY_OVERFLOW_TIMEOUT;
+	writeDrop = STORE_LINE;
+	captureDrop = STORE_LINE;
+	replayLines = 0;
+	replaySeconds = 0;
+	replayMarks = NULL;
+	bufLastNewline = true;
+	collapse = false;
+	collapseLineStart = true;
+	collapseComparing = false;
+	collapseHeld = 0;
+	collapseLinePos = 0;
+	collapsePrevPos = 0;
+	collapsePrevLen = 0;
+	collapseRepeats = 0;
+	collapseHoldoff = 0;
+	collapseRunHoldoff = 0;
+	collapseWrCount = 0;
+	collapseMixed = false;
+	clientLevel = TELNETSPY_LEVEL_VERBOSE;
+	clientTags[0] = 0;
+	grep = NULL;
+	grepAfter = 0;
+	governors = NULL;
+	governorHoldoff = 0;
+	governorDue = false;
+	adaptMin = 0;
+	adaptTarget = 0;
+	adaptMax = 0;
+	adaptReserve = 0;
+	adaptHoldoff = 0;
+	watermarkHigh = 0;
+	watermarkLow = 0;
+	backpressure = false;
+	callbackWatermark = NULL;
+	grepContextLeft = 0;
+	sendLineStart = true;
+	sendSkipLine = false;
+	sendCut = false;
+#ifdef TELNETSPY_LATENCY_STATS
+	clearLatencyStamps();
+	resetLatencyStats();
+#endif
+#ifdef TELNETSPY_TRACE
+	traceWrIdx = 0;
+	traceUsed = 0;
+	tracePaused = false;
+#endif
 	minBlockSize = TELNETSPY_MIN_BLOCK_SIZE;
 	collectingTime = TELNETSPY_COLLECTING_TIME;
 	maxBlockSize = TELNETSPY_MAX_BLOCK_SIZE;
@@ -97,27 +296,40 @@ TelnetSpy::TelnetSpy()
 #ifdef RLJ_SPY_MODS
 	pingHoldoff = 0;
 	waitHoldoff = 0;
-	NVTidx = 0;
+	wifiHoldoff = 0;
 #else
 	pingRef = 0xFFFFFFFF;
 	waitRef = 0xFFFFFFFF;
 #endif
 	nvtDetected = false;
+	binarySafe = false;
+	negotiation = TELNETSPY_NEGOTIATION;
+	windowWidth = 0;
+	windowHeight = 0;
+	memset(nvtOpt, 0, sizeof(nvtOpt));
+	oobUsed = 0;
+#ifdef TELNETSPY_MCCP
+	mccp = NULL;
+	mccpActive = false;
+#endif
+	nvtState = NVT_DATA;
+	nvtCmd = 0;
+#ifndef ESP8266
+	taskHandle = NULL;
+	taskStop = false;
+	taskRequests = 0;
+#endif
+	// the buffers are allocated on demand (see needBuffer and allocBuffers)
 	telnetBuf = NULL;
 	bufLen = 0;
-	uint16_t size = TELNETSPY_BUFFER_LEN;
-	while (!setBufferSize(size))
-	{
-		size = size >> 1;
-		if (size < minBlockSize)
-		{
-			setBufferSize(minBlockSize);
-			break;
-		}
-	}
+	bufSize = TELNETSPY_BUFFER_LEN;
+	allocHoldoff = 0;
 	recBuf = NULL;
 	recLen = 0;
-	setRecBufferSize(TELNETSPY_REC_BUFFER_LEN);
+	recSize = TELNETSPY_REC_BUFFER_LEN;
+	idleTime = 0;
+	idleFloor = 0;
+	idleHoldoff = 0;
 	debugOutput = TELNETSPY_CAPTURE_OS_PRINT;
 	if (debugOutput)
 	{
@@ -128,6 +340,14 @@ TelnetSpy::TelnetSpy()
 TelnetSpy::~TelnetSpy()
 {
 	end();
+	if (channelHost)
+	{
+		channelHost->removeChannel(*this);
+	}
+	while (channels)
+	{
+		removeChannel(*channels);
+	}
 	if (welcomeMsg)
 		free(welcomeMsg);
 	if (rejectMsg)
@@ -138,12 +358,25 @@ TelnetSpy::~TelnetSpy()
 		free(telnetBuf);
 	if (recBuf)
 		free(recBuf);
+#ifdef TELNETSPY_MCCP
+	if (mccp)
+		free(mccp);
+#endif
+#ifdef TELNETSPY_SYSLOG
+	stopSyslog();
+#endif
+	if (grep)
+		free(grep);
+	if (governors)
+		free(governors);
+	if (replayMarks)
+		free(replayMarks);
 }
 
 void TelnetSpy::setPort(uint16_t portToUse)
 {
 	port = portToUse;
-	if (listening)
+	if (listening && !passToTask(TASK_SET_PORT))
 	{
 		if (client.connected())
 		{
@@ -162,7 +395,7 @@ void TelnetSpy::setPort(uint16_t portToUse)
 		if (started)
 		{
 			telnetServer->begin();
-			telnetServer->setNoDelay(bufLen > 0);
+			telnetServer->setNoDelay(bufSize > 0);
 		}
 	}
 }
@@ -218,27 +451,140 @@ void TelnetSpy::setMaxBlockSize(uint16_t maxSize)
 	maxBlockSize = max(maxSize, minBlockSize);
 }
 
+static void TelnetSpy_reverse(char *from, char *to)
+{
+	while (from < --to)
+	{
+		char c = *from;
+		*from++ = *to;
+		*to = c;
+	}
+}
+
+// Rotates buf[0 .. len - 1] in place so that buf[first] becomes buf[0]
+static void TelnetSpy_rotate(char *buf, uint16_t len, uint16_t first)
+{
+	if ((first == 0) || (first >= len))
+	{
+		return;
+	}
+	TelnetSpy_reverse(buf, buf + first);
+	TelnetSpy_reverse(buf + first, buf + len);
+	TelnetSpy_reverse(buf, buf + len);
+}
+
 bool TelnetSpy::setBufferSize(uint16_t newSize)
+{
+	if (newSize && !telnetBuf)
+	{
+		bufSize = max(newSize, minBlockSize); // allocated with the first stored data or client
+		allocHoldoff = 0;
+		return true;
+	}
+	if (!resizeBuffer(newSize))
+	{
+		return false;
+	}
+	bufSize = bufLen;
+	if (telnetServer)
+	{
+		telnetServer->setNoDelay(bufSize > 0);
+	}
+	return true;
+}
+
+// Changes the size of the allocated transmit buffer, 0 frees it
+bool TelnetSpy::resizeBuffer(uint16_t newSize)
 {
 	if (telnetBuf && (bufLen == newSize))
 	{
 		return true;
 	}
+	bufReserved = 0; // the reserved spans are gone
 	if (newSize == 0)
 	{
+		CRITCAL_SECTION_START
+		char *old = telnetBuf;
+		telnetBuf = NULL;
 		bufLen = 0;
-		if (telnetBuf)
-		{
-			free(telnetBuf);
-			telnetBuf = NULL;
-		}
-		if (telnetServer)
+		bufUsed = 0;
+		bufRdIdx = 0;
+		bufWrIdx = 0;
+#ifdef RLJ_SPY_MODS
+		bufRdIdxStart = 0;
+		bufLeftToSend = 0;
+#endif
+#ifdef TELNETSPY_SYSLOG
+		sysRdIdx = 0;
+		sysLeftToSend = 0;
+#endif
+		CRITCAL_SECTION_END
+		if (old)
 		{
-			telnetServer->setNoDelay(false);
+			free(old);
 		}
 		return true;
 	}
 	newSize = max(newSize, minBlockSize);
+#ifdef RLJ_SPY_MODS
+	char *temp = (char *)malloc(newSize);
+	if (!temp && (!telnetBuf || (newSize > bufLen)))
+	{
+		return false; // nothing changed
+	}
+	char *old = NULL;
+	CRITCAL_SECTION_START
+	if (!telnetBuf)
+	{
+		telnetBuf = temp;
+		bufUsed = 0;
+		bufLeftToSend = 0;
+#ifdef TELNETSPY_SYSLOG
+		sysLeftToSend = 0;
+#endif
+	}
+	else
+	{
+		while (bufUsed > newSize)
+		{
+			removeOldestLine(); // keep the youngest lines
+		}
+		// the oldest byte goes to index 0, the read positions follow from the counts
+		if (temp)
+		{
+			uint16_t first = min(bufUsed, (uint16_t)(bufLen - bufRdIdxStart));
+			memcpy(temp, &telnetBuf[bufRdIdxStart], first);
+			memcpy(&temp[first], telnetBuf, bufUsed - first);
+			old = telnetBuf;
+			telnetBuf = temp;
+		}
+		else
+		{
+			TelnetSpy_rotate(telnetBuf, bufLen, bufRdIdxStart); // no memory for a copy: shrink in place
+		}
+	}
+	bufLen = newSize;
+	bufRdIdxStart = 0;
+	bufWrIdx = bufUsed % bufLen;
+	bufRdIdx = (bufUsed - min(bufLeftToSend, bufUsed)) % bufLen;
+#ifdef TELNETSPY_SYSLOG
+	sysRdIdx = (bufUsed - min(sysLeftToSend, bufUsed)) % bufLen;
+#endif
+	CRITCAL_SECTION_END
+	if (old)
+	{
+		free(old);
+	}
+	else if (!temp)
+	{
+		// shrinking returns the tail to the heap, in place as there was no block of this size
+		temp = (char *)realloc(telnetBuf, newSize);
+		if (temp)
+		{
+			telnetBuf = temp;
+		}
+	}
+#else
 	uint16_t oldBufLen = bufLen;
 	bufLen = newSize;
 	uint16_t tmp;
@@ -247,6 +593,10 @@ bool TelnetSpy::setBufferSize(uint16_t newSize)
 		bufRdIdx = 0;
 		bufWrIdx = 0;
 		bufUsed = 0;
+#ifdef RLJ_SPY_MODS
+		bufRdIdxStart = 0;
+		bufLeftToSend = 0;
+#endif
 	}
 	else
 	{
@@ -314,10 +664,7 @@ bool TelnetSpy::setBufferSize(uint16_t newSize)
 		memcpy(&telnetBuf[tmp], &telnetBuf[bufRdIdx], oldBufLen - bufRdIdx);
 		bufRdIdx = tmp;
 	}
-	if (telnetServer)
-	{
-		telnetServer->setNoDelay(true);
-	}
+#endif
 	return true;
 }
 
@@ -325,11 +672,232 @@ uint16_t TelnetSpy::getBufferSize()
 {
 	if (!telnetBuf)
 	{
-		return 0;
+		return bufSize; // allocated on demand
 	}
 	return bufLen;
 }
 
+bool TelnetSpy::setAdaptiveBuffer(uint16_t minSize, uint16_t targetSize, uint16_t maxSize, uint32_t heapReserve)
+{
+	if (!minSize)
+	{
+		adaptMin = 0; // the buffer keeps its actual size
+		return true;
+	}
+	adaptMin = max(minSize, minBlockSize);
+	adaptTarget = max(targetSize, adaptMin);
+	adaptMax = max(maxSize, adaptTarget);
+	adaptReserve = heapReserve;
+	bool ok = true;
+	if (getBufferSize() < adaptMin)
+	{
+		ok = setBufferSize(adaptMin);
+	}
+	else if (bufLen > adaptMax)
+	{
+		ok = setBufferSize(adaptMax);
+	}
+	adaptHoldoff = 0; // check the heap with the next handle()
+	return ok;
+}
+
+// Returns the ms until the next check
+uint32_t TelnetSpy::adaptBuffer()
+{
+	if (isHoldoff(adaptHoldoff))
+	{
+		return holdoffLeft(adaptHoldoff);
+	}
+	setHoldoff(adaptHoldoff, TELNETSPY_HEAP_CHECK);
+	if (bufReserved || (telnetBuf && (bufLen < bufSize)))
+	{
+		return TELNETSPY_HEAP_CHECK; // a reservation holds pointers into the buffer / shrunk while idle
+	}
+	uint32_t freeHeap = ESP.getFreeHeap();
+#ifdef ESP8266
+	uint32_t maxBlock = ESP.getMaxFreeBlockSize();
+#else
+	uint32_t maxBlock = ESP.getMaxAllocHeap();
+#endif
+	uint16_t size = getBufferSize();
+	uint16_t newSize = size;
+	if ((freeHeap < adaptReserve) || (maxBlock < adaptReserve / 4))
+	{
+		// memory is short (or fragmented): give back half of the buffer
+		newSize = max(adaptMin, (uint16_t)(size / 2));
+	}
+	else
+	{
+		uint16_t pending = getBufferPending();
+		// readers lagging behind may use the buffer up to the maximum size
+		uint16_t goal = (pending > size / 2) ? adaptMax : adaptTarget;
+		if (size < goal)
+		{
+			// grow in steps, a new block of the new size must fit beside the reserve
+			uint16_t grow = max(adaptMin, (uint16_t)min((uint32_t)goal, (uint32_t)size * 2));
+			if ((freeHeap >= (uint32_t)grow + adaptReserve) && (maxBlock >= grow))
+			{
+				newSize = grow;
+			}
+		}
+		else if ((size > goal) && (pending < size / 4))
+		{
+			newSize = max(goal, (uint16_t)(size / 2));
+		}
+	}
+	if (newSize != size)
+	{
+		setBufferSize(newSize);
+	}
+	return TELNETSPY_HEAP_CHECK;
+}
+
+// Allocates the transmit buffer with the first data to store, returns false if there is none
+bool TelnetSpy::needBuffer()
+{
+	if (telnetBuf)
+	{
+		return true;
+	}
+	if (isHoldoff(allocHoldoff))
+	{
+		return false; // the heap is checked again later, not with each byte
+	}
+	uint16_t size = bufSize;
+	while (size && !resizeBuffer(size))
+	{
+		size = size >> 1;
+		if (size < minBlockSize)
+		{
+			setHoldoff(allocHoldoff, TELNETSPY_HEAP_CHECK);
+			return false;
+		}
+	}
+	bufSize = bufLen; // a smaller buffer is not retried with each byte
+	return telnetBuf != NULL;
+}
+
+// Allocates the buffers for a new client (again in full size)
+void TelnetSpy::allocBuffers()
+{
+	allocHoldoff = 0; // try again for the client
+	if (telnetBuf && (bufLen < bufSize) && !resizeBuffer(bufSize))
+	{
+		bufSize = bufLen;
+	}
+	needBuffer();
+	if (recSize && !recBuf)
+	{
+		setRecBufferSize(recSize);
+	}
+}
+
+void TelnetSpy::setIdleRelease(uint32_t time, uint16_t floorSize)
+{
+	idleTime = time;
+	idleFloor = floorSize ? max(floorSize, minBlockSize) : 0;
+	setHoldoff(idleHoldoff, idleTime);
+}
+
+// Returns the ms until the buffers may be released
+uint32_t TelnetSpy::releaseIdle()
+{
+	if (connected || bufReserved || collapseHeld || collapseRepeats || (recBuf && recUsed) || getBufferPending())
+	{
+		setHoldoff(idleHoldoff, idleTime);
+		return idleTime;
+	}
+	if (isHoldoff(idleHoldoff))
+	{
+		return holdoffLeft(idleHoldoff);
+	}
+	if (recBuf)
+	{
+		CRITCAL_SECTION_START
+		char *old = recBuf;
+		recBuf = NULL;
+		recLen = 0;
+		CRITCAL_SECTION_END
+		free(old);
+	}
+	if (telnetBuf && (bufLen > idleFloor))
+	{
+		resizeBuffer(idleFloor); // keeps the youngest lines (0: frees the buffer)
+	}
+	return TELNETSPY_NO_DEADLINE;
+}
+
+uint16_t TelnetSpy::getBufferUsed()
+{
+	return bufUsed;
+}
+
+// Data not yet taken by the slowest reader
+uint16_t TelnetSpy::getBufferPending()
+{
+	CRITCAL_SECTION_START
+	uint16_t pending = bufLeftToSend;
+#ifdef TELNETSPY_SYSLOG
+	if (syslogUdp)
+	{
+		pending = max(pending, sysLeftToSend);
+	}
+#endif
+	for (TelnetSpySink *sink = sinks; sink; sink = sink->nextSink)
+	{
+		pending = max(pending, (uint16_t)min(bufWrCount - sink->pos, (uint32_t)bufUsed));
+	}
+	pending = min(pending, bufUsed);
+	CRITCAL_SECTION_END
+	return pending;
+}
+
+void TelnetSpy::setWatermarks(uint16_t high, uint16_t low)
+{
+	watermarkHigh = high;
+	watermarkLow = min(low, high);
+	checkWatermarks();
+}
+
+bool TelnetSpy::isBackpressure()
+{
+	return backpressure;
+}
+
+void TelnetSpy::setCallbackOnWatermark(void (*callback)(bool high))
+{
+	callbackWatermark = callback;
+}
+
+void TelnetSpy::checkWatermarks()
+{
+	bool high = backpressure;
+	if (!watermarkHigh)
+	{
+		high = false;
+	}
+	else
+	{
+		uint16_t pending = getBufferPending();
+		if (pending >= watermarkHigh)
+		{
+			high = true;
+		}
+		else if (pending <= watermarkLow)
+		{
+			high = false;
+		}
+	}
+	if (high != backpressure)
+	{
+		backpressure = high;
+		if (callbackWatermark)
+		{
+			callbackWatermark(high);
+		}
+	}
+}
+
 void TelnetSpy::setStoreOffline(bool store)
 {
 	storeOffline = store;
@@ -362,10 +930,15 @@ void TelnetSpy::setPingTime(uint16_t pngTime)
 
 bool TelnetSpy::setRecBufferSize(uint16_t newSize)
 {
+	recSize = newSize;
 	if (recBuf && (recLen == newSize))
 	{
 		return true;
 	}
+	if (!recBuf && !client.connected())
+	{
+		return true; // allocated when a client connects
+	}
 	if (recBuf)
 	{
 		free(recBuf);
@@ -392,7 +965,7 @@ uint16_t TelnetSpy::getRecBufferSize()
 {
 	if (!recBuf)
 	{
-		return 0;
+		return recSize; // allocated on demand
 	}
 	return recLen;
 }
@@ -409,47 +982,38 @@ void TelnetSpy::setSerial(HardwareSerial *usedSerial)
 
 size_t TelnetSpy::write(uint8_t data)
 {
-	if (isEnabled) // Skip Telnet processing if not enabled
+	if (governors)
 	{
-		if (telnetBuf)
+		if (!governByte(GOVERN_WRITE, data))
 		{
-			if (storeOffline || client.connected())
-			{
-				if (bufUsed == bufLen)
-				{ // BUFFER IS FULL!
-					if (client.connected())
-					{
-						sendBlock(); // try and send - but why? - does not change avaialble write space!
-					}
-					if (bufUsed == bufLen)
-					{ // buffer is 100% full, shed oldest line
-#ifdef RLJ_SPY_MODS
-						removeOldestLine();
-#else
-						char c;
-						while (bufUsed > 0)
-						{
-							c = pullTelnetBuf();
-							if (c == '\n')
-							{
-								break;
-							}
-						}
-						if (peekTelnetBuf() == '\r')
-						{
-							pullTelnetBuf();
-						}
-#endif
-					}
+			return 1; // line suppressed by the governor
+		}
+		if (governorDue)
+		{
+			governorReport(); // before the line, if it is time to do so
+		}
+	}
+	if (isEnabled) // Skip Telnet processing if not enabled
+	{
+		if (telnetBuf || bufSize)
+		{
+			if ((storeOffline || isOnline()) && needBuffer())
+			{
+				if (collapse)
+				{
+					collapseByte(data);
+				}
+				else
+				{
+					storeByte(data);
 				}
-				addTelnetBuf(data);
 			}
 		}
 		else
 		{
-			if (client.connected())
+			if (!taskOwnsClient() && client.connected()) // unbuffered data cannot be passed to the task
 			{
-				client.write(data);
+				writeClient(&data, 1);
 			}
 		}
 	}
@@ -461,40 +1025,378 @@ size_t TelnetSpy::write(uint8_t data)
 	return 1;
 }
 
-void TelnetSpy::debugWrite(uint8_t data)
+// Stores a byte of write()
+void TelnetSpy::storeByte(char c)
 {
-	if (telnetBuf)
+	if (dropByte(writeDrop, c, true))
+	{
+		return;
+	}
+	addTelnetBuf(c);
+#ifndef ESP8266
+	if (bufLeftToSend == minBlockSize)
+	{
+		notifyTask(); // a block is ready to send
+	}
+#endif
+	if (watermarkHigh && !backpressure && (c == '\n') && (bufUsed >= watermarkHigh))
+	{
+		checkWatermarks(); // once per line, handle() checks in between
+	}
+}
+
+void TelnetSpy::setCollapse(bool enable)
+{
+	if (!enable)
+	{
+		collapseFlush(true);
+	}
+	collapse = enable;
+}
+
+bool TelnetSpy::getCollapse()
+{
+	return collapse;
+}
+
+// Holds back the bytes of a line as long as they are the same as of the line before
+void TelnetSpy::collapseByte(char c)
+{
+	if (bufWrCount != collapseWrCount)
+	{
+		// others stored data meanwhile (commit, system output, summaries, ...)
+		collapseFlush(true);
+		collapseComparing = false;
+		collapsePrevLen = 0; // the line before is not the sketch's line
+		if (!collapseLineStart || !bufLastNewline)
+		{
+			collapseLineStart = false;
+			collapseMixed = true;
+		}
+		collapseWrCount = bufWrCount;
+	}
+	if (collapseLineStart)
 	{
-		if (storeOffline || client.connected())
+		collapseLineStart = false;
+		// the line before must still be in the buffer, also while its start is copied
+		collapseComparing = collapsePrevLen && (collapsePrevLen <= bufLen / 4) && ((bufWrCount - collapsePrevPos) <= bufUsed);
+		collapseHeld = 0;
+		collapseLinePos = bufWrCount;
+	}
+	if (collapseComparing)
+	{
+		uint32_t oldest = bufWrCount - bufUsed;
+		uint32_t pos = collapsePrevPos + collapseHeld;
+		if ((collapseHeld < collapsePrevLen) && ((int32_t)(pos - oldest) >= 0) &&
+			(telnetBuf[(bufRdIdxStart + (pos - oldest)) % bufLen] == c))
 		{
-			if (bufUsed == bufLen)
+			if (!collapseRepeats && !collapseHeld)
 			{
-#ifdef RLJ_SPY_MODS
-				removeOldestLine();
+				setHoldoff(collapseRunHoldoff, TELNETSPY_COLLAPSE_REPORT); // a run starts
+			}
+			setHoldoff(collapseHoldoff, collectingTime);
+			if (c == '\n')
+			{
+				collapseRepeats++; // the whole line is the same
+				collapseHeld = 0;
+				collapseLineStart = true;
+			}
+			else
+			{
+				collapseHeld++;
+			}
+			return;
+		}
+		collapseFlush(true); // this line is different
+		collapseComparing = false;
+	}
+	storeByte(c);
+	collapseWrCount = bufWrCount;
+	if (c == '\n')
+	{
+		collapsePrevPos = collapseLinePos;
+		collapsePrevLen = collapseMixed ? 0 : bufWrCount - collapseLinePos;
+		collapseMixed = false;
+		collapseLineStart = true;
+	}
+}
+
+// Stores the number of repeats and the held bytes (if forced, after the collecting
+// time without new data or TELNETSPY_COLLAPSE_REPORT ms after the run started)
+uint32_t TelnetSpy::collapseFlush(bool force)
+{
+	if (!collapseRepeats && !collapseHeld)
+	{
+		return TELNETSPY_NO_DEADLINE;
+	}
+	if (!force && isHoldoff(collapseHoldoff) && isHoldoff(collapseRunHoldoff))
+	{
+		return min(holdoffLeft(collapseHoldoff), holdoffLeft(collapseRunHoldoff));
+	}
+	bool ours = (bufWrCount == collapseWrCount); // else collapseByte notices the data of others
+	if (collapseRepeats)
+	{
+		char msg[56];
+		int len = snprintf(msg, sizeof(msg), "TelnetSpy: last line repeated %lu times\r\n", (unsigned long)collapseRepeats);
+		collapseRepeats = 0;
+		for (int i = 0; i < len; i++)
+		{
+			storeByte(msg[i]);
+		}
+	}
+	// the held bytes are the start of the line before
+	collapseLinePos = bufWrCount;
+	uint32_t pos = collapsePrevPos;
+	for (; collapseHeld > 0; collapseHeld--, pos++)
+	{
+		uint32_t oldest = bufWrCount - bufUsed;
+		if ((int32_t)(pos - oldest) < 0)
+		{
+			collapseHeld = 0; // evicted, not possible for short lines
+			break;
+		}
+		storeByte(telnetBuf[(bufRdIdxStart + (pos - oldest)) % bufLen]);
+	}
+	collapseComparing = false;
+	if (ours)
+	{
+		collapseWrCount = bufWrCount;
+	}
+	return TELNETSPY_NO_DEADLINE;
+}
+
+uint16_t TelnetSpy::reserve(uint16_t len, char *&data1, uint16_t &len1, char *&data2, uint16_t &len2)
+{
+	data1 = data2 = NULL;
+	len1 = len2 = 0;
+	bufReserved = 0;
+	if (collapse)
+	{
+		collapseFlush(true); // the held bytes come first
+	}
+	if (!isEnabled || !(storeOffline || isOnline()) || !needBuffer())
+	{
+		return 0;
+	}
+	len = min(len, bufLen);
+	CRITCAL_SECTION_START
+	while ((bufLen - bufUsed < len) && ((overflow != OVERFLOW_DROP_NEWEST) || isOldestLineSent()))
+	{
+		removeOldestLine();
+	}
+	len = min(len, (uint16_t)(bufLen - bufUsed));
+	CRITCAL_SECTION_END
+	if (len == 0)
+	{
+		return 0;
+	}
+	bufReserved = len;
+	data1 = &telnetBuf[bufWrIdx];
+	len1 = min(len, (uint16_t)(bufLen - bufWrIdx));
+	if (len1 < len)
+	{
+		data2 = telnetBuf;
+		len2 = len - len1;
+	}
+	return len;
+}
+
+void TelnetSpy::commit(uint16_t len)
+{
+	len = min(len, bufReserved);
+	bufReserved = 0;
+	if (len == 0)
+	{
+		return;
+	}
+	uint16_t first = min(len, (uint16_t)(bufLen - bufWrIdx));
+	const char *data = &telnetBuf[bufWrIdx];
+	CRITCAL_SECTION_START
+#ifdef TELNETSPY_LATENCY_STATS
+	stampLatency();
+#endif
+	if (replayMarks && bufLastNewline)
+	{
+		markLine();
+	}
+	bufLastNewline = (telnetBuf[(bufWrIdx + len - 1) % bufLen] == '\n');
+	bufWrCount += len;
+	bufWrIdx = (bufWrIdx + len) % bufLen;
+	bufUsed += len;
+	bufLeftToSend += len;
+#ifdef TELNETSPY_SYSLOG
+	if (syslogUdp)
+	{
+		sysLeftToSend += len;
+	}
+#endif
+	CRITCAL_SECTION_END
+#ifndef ESP8266
+	if (bufLeftToSend >= minBlockSize)
+	{
+		notifyTask(); // a block is ready to send
+	}
+#endif
+	if (watermarkHigh && !backpressure && bufLastNewline && (bufUsed >= watermarkHigh))
+	{
+		checkWatermarks(); // at line ends only, handle() checks in between
+	}
+	if ((NULL != usedSer) && *usedSer)
+	{
+		usedSer->write((const uint8_t *)data, first);
+		if (len > first)
+		{
+			usedSer->write((const uint8_t *)telnetBuf, len - first);
+		}
+	}
+}
+
+void TelnetSpy::debugWrite(uint8_t data)
+{
+	storeDebug((const char *)&data, 1, GOVERN_OS_PRINT);
+#ifdef ESP8266
+	ets_putc(data);
 #else
-				char c;
-				while (bufUsed > 0)
-				{
-					c = pullTelnetBuf();
-					if (c == '\n')
-					{
-						break;
-					}
-				}
-				if (peekTelnetBuf() == '\r')
+	ets_write_char_uart(data);
+#endif
+}
+
+// Puts system output into the buffer (it was written to the UART already)
+void TelnetSpy::storeDebug(const char *data, size_t len, uint8_t source)
+{
+	if (!(storeOffline || isOnline()) || !needBuffer())
+	{
+		return;
+	}
+	CRITCAL_SECTION_START
+	for (size_t i = 0; i < len; i++)
+	{
+		if (governors && !governByte(source, data[i]))
+		{
+			continue;
+		}
+		if (!dropByte(captureDrop, data[i], false))
+		{
+			addTelnetBuf(data[i]);
+		}
+	}
+	CRITCAL_SECTION_END
+}
+
+// Moves the staged system output of all sources targeting this instance into the buffer
+void TelnetSpy::drainCapture()
+{
+	if (bufReserved)
+	{
+		return; // the staging ring keeps the data until commit()
+	}
+	char batch[TELNETSPY_CAPTURE_BATCH];
+	for (uint8_t source = 0; source < TELNETSPY_CAPTURE_SOURCES; source++)
+	{
+		TelnetSpyCapture &cap = captures[source];
+		if (cap.target != this)
+		{
+			continue;
+		}
+		size_t len;
+		do
+		{
+			len = 0;
+			while (len < sizeof(batch))
+			{
+				uint32_t idx = cap.rdIdx & (TELNETSPY_CAPTURE_LEN - 1);
+				char c = cap.buf[idx];
+				if (c == 0)
 				{
-					pullTelnetBuf();
+					break; // empty or reserved, but not written yet
 				}
+				batch[len++] = c;
+				cap.buf[idx] = 0;
+#ifdef ESP8266
+				cap.rdIdx++;
+#else
+				__atomic_store_n(&cap.rdIdx, cap.rdIdx + 1, __ATOMIC_RELEASE); // the slot is free before
 #endif
 			}
-			addTelnetBuf(data);
+			storeDebug(batch, len, source + 1); // GOVERN_OS_PRINT, ...
+		} while (len == sizeof(batch));
+		uint32_t lost = cap.lost;
+		if (lost != cap.lostReported)
+		{
+			char msg[56];
+			int msgLen = snprintf(msg, sizeof(msg), "\r\nTelnetSpy: %lu bytes of system output lost\r\n", (unsigned long)(lost - cap.lostReported));
+			cap.lostReported = lost;
+			storeDebug(msg, msgLen, source + 1);
+		}
+	}
+}
+
+void TelnetSpy::setCapture(captureSource source, bool enable)
+{
+	if (source >= TELNETSPY_CAPTURE_SOURCES)
+	{
+		return;
+	}
+	TelnetSpyCapture &cap = captures[source];
+	if (enable)
+	{
+		if (cap.target && (cap.target != this))
+		{
+			cap.target->drainCapture(); // staged output belongs to the previous target
 		}
+		cap.target = this;
+	}
+	else if (cap.target == this)
+	{
+		drainCapture();
+		cap.target = NULL;
+	}
+	else
+	{
+		return;
 	}
+	switch (source)
+	{
+	case CAPTURE_OS_PRINT:
+		if (enable)
+		{
+			ets_install_putc1(TelnetSpy_putc); // Set system printing (os_printf) to TelnetSpy
 #ifdef ESP8266
-	ets_putc(data);
-#else
-	ets_write_char_uart(data);
+			system_set_os_print(true);
+#endif
+		}
+		else
+		{
+#ifdef ESP8266
+			system_set_os_print(false);
 #endif
+			ets_install_putc1(TelnetSpy_ignore_putc); // Ignore system printing
+		}
+		break;
+#ifndef ESP8266
+	case CAPTURE_ESP_LOG:
+		if (enable)
+		{
+			if (TelnetSpy_prevVprintf == NULL)
+			{
+				TelnetSpy_prevVprintf = esp_log_set_vprintf(TelnetSpy_vprintf);
+			}
+		}
+		else if (TelnetSpy_prevVprintf)
+		{
+			esp_log_set_vprintf(TelnetSpy_prevVprintf);
+			TelnetSpy_prevVprintf = NULL;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+bool TelnetSpy::getCapture(captureSource source)
+{
+	return (source < TELNETSPY_CAPTURE_SOURCES) && (captures[source].target == this);
 }
 
 int TelnetSpy::available(void)
@@ -556,62 +1458,160 @@ int TelnetSpy::read(void)
 	return val;
 }
 
-int TelnetSpy::peek(void)
+int TelnetSpy::read(uint8_t *buffer, size_t size)
 {
-	int val = -1;
+	size_t done = 0;
 	if (usedSer)
 	{
-		val = usedSer->peek();
-		if (val != -1)
+		int avail = usedSer->available();
+		if (avail > 0)
 		{
-			return val;
+			int len = usedSer->read(buffer, min((size_t)avail, size));
+			if (len > 0)
+			{
+				done = len;
+			}
 		}
 	}
-	if (client.connected())
+	if ((done < size) && client.connected())
 	{
 		if (telnetAvailable())
 		{
 			if (recBuf)
 			{
-				val = recBuf[recRdIdx];
+				bool found;
+				done += pullRecBuf(&buffer[done], size - done, -1, found);
 			}
 			else
 			{
-				val = client.peek();
+				int len = client.read(&buffer[done], size - done);
+				if (len > 0)
+				{
+					done += len;
+				}
 			}
 		}
 	}
-	return val;
+	return done;
 }
 
-void TelnetSpy::flush(void)
+size_t TelnetSpy::readBytes(char *buffer, size_t length)
 {
-	if (usedSer)
-	{
-		usedSer->flush();
-	}
-	if (client.connected())
+	size_t done = 0;
+	while (done < length)
 	{
-		sendBlock();
-		client.flush();
+		done += read((uint8_t *)&buffer[done], length - done);
+		if (done >= length)
+		{
+			break;
+		}
+		// Nothing left: wait for the next character (up to the stream timeout)
+		int c = timedRead();
+		if (c < 0)
+		{
+			break;
+		}
+		buffer[done++] = (char)c;
 	}
+	return done;
 }
 
-#ifdef ESP8266
-
-void TelnetSpy::begin(unsigned long baud, SerialConfig config, SerialMode mode, uint8_t tx_pin)
+size_t TelnetSpy::readBytesUntil(char terminator, char *buffer, size_t length)
 {
-	if (usedSer)
+	size_t done = 0;
+	while (done < length)
 	{
-		usedSer->begin(baud, config, mode, tx_pin);
+		int c;
+		if (usedSer && (usedSer->available() > 0))
+		{
+			// The terminator must not be consumed behind it, so the serial port is read by character
+			c = usedSer->read();
+		}
+		else
+		{
+			if (recBuf && client.connected() && telnetAvailable())
+			{
+				bool found;
+				done += pullRecBuf((uint8_t *)&buffer[done], length - done, (uint8_t)terminator, found);
+				if (found)
+				{
+					break;
+				}
+				continue;
+			}
+			c = timedRead();
+		}
+		if ((c < 0) || ((char)c == terminator))
+		{
+			break;
+		}
+		buffer[done++] = (char)c;
 	}
-	setDebugOutput(debugOutput);
-	started = true;
+	return done;
 }
 
-#else // ESP32
-
-void TelnetSpy::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin, bool invert)
+int TelnetSpy::peek(void)
+{
+	int val = -1;
+	if (usedSer)
+	{
+		val = usedSer->peek();
+		if (val != -1)
+		{
+			return val;
+		}
+	}
+	if (client.connected())
+	{
+		if (telnetAvailable())
+		{
+			if (recBuf)
+			{
+				val = recBuf[recRdIdx];
+			}
+			else
+			{
+				val = client.peek();
+			}
+		}
+	}
+	return val;
+}
+
+void TelnetSpy::flush(void)
+{
+	if (usedSer)
+	{
+		usedSer->flush();
+	}
+	if (taskOwnsClient())
+	{
+#ifndef ESP8266
+		notifyTask();
+#endif
+	}
+	else if (client.connected())
+	{
+		sendBlock();
+		client.flush();
+	}
+}
+
+#ifdef ESP8266
+
+void TelnetSpy::begin(unsigned long baud, SerialConfig config, SerialMode mode, uint8_t tx_pin)
+{
+	if (usedSer)
+	{
+		usedSer->begin(baud, config, mode, tx_pin);
+	}
+	setDebugOutput(debugOutput);
+	started = true;
+}
+
+#else // ESP32
+
+void TelnetSpy::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin, bool invert)
 {
 	if (usedSer)
 	{
@@ -629,10 +1629,17 @@ void TelnetSpy::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t
 
 void TelnetSpy::end()
 {
+#ifndef ESP8266
+	stopTask();
+#endif
 	if (debugOutput)
 	{
 		setDebugOutput(false);
 	}
+	for (uint8_t source = 0; source < TELNETSPY_CAPTURE_SOURCES; source++)
+	{
+		setCapture((captureSource)source, false);
+	}
 	if (usedSer)
 	{
 		usedSer->end();
@@ -703,17 +1710,17 @@ bool TelnetSpy::isRxEnabled(void)
 
 int TelnetSpy::availableForWrite(void)
 {
-#ifdef RLJ_SPY_MODS
-	if (NVTidx)
+	if (!telnetBuf && !bufSize)
 	{
-		return NVTidx;
+		// Without buffer the data is written to the client directly
+		return usedSer ? usedSer->availableForWrite() : maxBlockSize;
 	}
-#endif
+	int room = telnetBuf ? bufLen - bufUsed : bufSize;
 	if (usedSer)
 	{
-		return min(usedSer->availableForWrite(), bufLen - bufUsed);
+		return min(usedSer->availableForWrite(), room);
 	}
-	return bufLen - bufUsed;
+	return room;
 }
 
 TelnetSpy::operator bool() const
@@ -728,25 +1735,7 @@ TelnetSpy::operator bool() const
 void TelnetSpy::setDebugOutput(bool en)
 {
 	debugOutput = en;
-	if (debugOutput)
-	{
-		actualObject = this;
-		ets_install_putc1(TelnetSpy_putc); // Set system printing (os_printf) to TelnetSpy
-#ifdef ESP8266
-		system_set_os_print(true);
-#endif
-	}
-	else
-	{
-		if (actualObject == this)
-		{
-#ifdef ESP8266
-			system_set_os_print(false);
-#endif
-			ets_install_putc1(TelnetSpy_ignore_putc); // Ignore system printing
-			actualObject = NULL;
-		}
-	}
+	setCapture(CAPTURE_OS_PRINT, en);
 }
 
 uint32_t TelnetSpy::baudRate(void)
@@ -761,37 +1750,52 @@ uint32_t TelnetSpy::baudRate(void)
 #ifdef RLJ_SPY_MODS
 void TelnetSpy::sendBlock()
 {
-	bool action = false;
-	CRITCAL_SECTION_START
-	uint16_t idx = NVTidx; // avoid tainting telnet buffer with pings
-	uint8_t NVTcpy[2] = {NVT[0], NVT[1]};
-	NVTidx = 0;
-	CRITCAL_SECTION_END
-	if (idx)
-	{ // typ. telnet NOP being sent out of bounds
-		client.write(&NVTcpy[--idx], 1);
-		if (idx)
-		{
-			client.write(&NVTcpy[--idx], 1);
-		}
-		action = true;
+	TELNETSPY_TRACE_SCOPE(TRACE_SEND)
+#ifdef TELNETSPY_WEBSOCKET
+	if (wsState == WS_HANDSHAKE)
+	{
+		return;
 	}
-	CRITCAL_SECTION_START
-	uint16_t len = bufLeftToSend;
-	if (len > maxBlockSize)
+#endif
+	bool action = sendOob(); // typ. telnet NOP or option negotiation being sent out of bounds
+	if (sendCut)
 	{
-		len = maxBlockSize;
+		sendCut = false;
+		writeClient((const uint8_t *)"\r\n", 2); // end the line, its rest was evicted
+		action = true;
 	}
-	len = min(len, (uint16_t)(bufLen - bufRdIdx)); // in case we approaching the end of buffer memory (wraparound)
-	idx = bufRdIdx;
-	CRITCAL_SECTION_END
-	if (len)
+	bool filter = isClientFiltered();
+	uint16_t budget = maxBlockSize;
+	while (budget > 0)
 	{
+		CRITCAL_SECTION_START
+		uint16_t len = min(bufLeftToSend, budget);
+		len = min(len, (uint16_t)(bufLen - bufRdIdx)); // in case we approaching the end of buffer memory (wraparound)
+		uint16_t idx = bufRdIdx;
+		CRITCAL_SECTION_END
+		bool skip = false;
+		if (len && filter)
+		{
+			len = filterRun(idx, len, skip);
+		}
+		if (!len)
+		{
+			break;
+		}
 #ifdef DEBUG_TENETSPY
 		TELNETSPY_SERIALPORT.printf("TelnetSpy:%d %d %d %d %d %d\r\n", bufRdIdxStart, len, bufLeftToSend, bufRdIdx, bufUsed, bufLen); // DEBUG directly to serial port, always
 #endif
-		action = true;
-		client.write(&telnetBuf[idx], len);
+		if (!skip)
+		{
+			action = true;
+			writeClient((const uint8_t *)&telnetBuf[idx], len);
+			budget -= len;
+			if (!filter)
+			{
+				sendLineStart = (telnetBuf[idx + len - 1] == '\n');
+				sendSkipLine = false;
+			}
+		}
 		CRITCAL_SECTION_START
 		bufRdIdx += len;
 		if (bufRdIdx >= bufLen)
@@ -799,7 +1803,14 @@ void TelnetSpy::sendBlock()
 			bufRdIdx -= bufLen; // BUG FIX? was =0, nah len should be constrained, but still .....
 		}
 		bufLeftToSend -= len;
+#ifdef TELNETSPY_LATENCY_STATS
+		recordLatency();
+#endif
 		CRITCAL_SECTION_END
+		if (!filter)
+		{
+			break; // one write per block, the rest after a wraparound is sent next time
+		}
 	}
 
 	if (action)
@@ -812,6 +1823,7 @@ void TelnetSpy::sendBlock()
 #else
 void TelnetSpy::sendBlock()
 {
+	sendOob();
 	CRITCAL_SECTION_START
 	uint16_t len = bufUsed;
 	if (len > maxBlockSize)
@@ -825,7 +1837,7 @@ void TelnetSpy::sendBlock()
 	{
 		return;
 	}
-	client.write(&telnetBuf[idx], len);
+	writeClient((const uint8_t *)&telnetBuf[idx], len);
 	CRITCAL_SECTION_START
 	bufRdIdx += len;
 	if (bufRdIdx >= bufLen)
@@ -851,6 +1863,130 @@ void TelnetSpy::sendBlock()
 }
 #endif
 
+// Returns the first IAC (0xff) in [p, end) or end. The aligned middle part is
+// scanned a word at a time: a byte of ~word is zero exactly if it was 0xff.
+static const uint8_t *findIAC(const uint8_t *p, const uint8_t *end)
+{
+	while ((p < end) && ((uintptr_t)p & (sizeof(uint32_t) - 1)))
+	{
+		if (*p == 255)
+		{
+			return p;
+		}
+		p++;
+	}
+	while ((end - p) >= (ptrdiff_t)sizeof(uint32_t))
+	{
+		uint32_t v;
+		memcpy(&v, p, sizeof(v)); // aligned, so this is a single load
+		v = ~v;
+		if ((v - 0x01010101UL) & ~v & 0x80808080UL)
+		{
+			break; // the byte is located below
+		}
+		p += sizeof(uint32_t);
+	}
+	while ((p < end) && (*p != 255))
+	{
+		p++;
+	}
+	return p;
+}
+
+// Sends buffered data to the client. In binary safe mode each IAC (0xff) is
+// doubled here, so the transmit buffer itself always holds the raw data.
+void TelnetSpy::writeClient(const uint8_t *data, size_t len)
+{
+	if (channelHost)
+	{
+		channelHost->selectChannel(channelId);
+	}
+	else
+	{
+		selectChannel(0);
+	}
+	const uint8_t *end = data + len;
+	const uint8_t *iac = (binarySafe && !isWebSocketClient()) ? findIAC(data, end) : end;
+	if (iac == end)
+	{
+		transmit(data, len);
+		return;
+	}
+	// Collect runs and escapes in a small block to avoid tiny TCP packets
+	uint8_t block[TELNETSPY_ESCAPE_BLOCK];
+	size_t used = 0;
+	while (data < end)
+	{
+		size_t run = min((size_t)(iac - data), sizeof(block) - used);
+		memcpy(&block[used], data, run);
+		used += run;
+		data += run;
+		if ((data == iac) && (data < end) && ((sizeof(block) - used) >= 2))
+		{
+			block[used++] = 255;
+			block[used++] = 255;
+			data++;
+			iac = findIAC(data, end);
+		}
+		if ((sizeof(block) - used) < 2)
+		{
+			transmit(block, used);
+			used = 0;
+		}
+	}
+	if (used)
+	{
+		transmit(block, used);
+	}
+}
+
+// All data for the client except the welcome message passes this function
+void TelnetSpy::transmit(const uint8_t *data, size_t len)
+{
+	if (channelHost)
+	{
+		channelHost->transmit(data, len);
+		return;
+	}
+#ifdef TELNETSPY_WEBSOCKET
+	if (wsState == WS_OPEN)
+	{
+		wsFrame(2, data, len); // binary frame
+		return;
+	}
+	if (wsState == WS_HANDSHAKE)
+	{
+		return;
+	}
+#endif
+#ifdef TELNETSPY_MCCP
+	if (mccpActive)
+	{
+		deflateData(data, len);
+		return;
+	}
+#endif
+	client.write(data, len);
+}
+
+void TelnetSpy::setBinarySafe(bool enable)
+{
+	binarySafe = enable;
+	if (connected && negotiation)
+	{
+		requestOption(enable ? 251 : 252, 0); // WILL / WON'T BINARY
+		if (enable)
+		{
+			requestOption(253, 0); // DO BINARY
+		}
+	}
+}
+
+bool TelnetSpy::getBinarySafe()
+{
+	return binarySafe;
+}
+
 void TelnetSpy::addTelnetBuf(char c)
 {
 #ifdef RLJ_SPY_MODS
@@ -859,6 +1995,15 @@ void TelnetSpy::addTelnetBuf(char c)
 	{
 		removeOldestLine(); // get rid of oldest line in the buffer, reducing bufUsed in the process
 	}
+#ifdef TELNETSPY_LATENCY_STATS
+	stampLatency();
+#endif
+	if (replayMarks && bufLastNewline)
+	{
+		markLine();
+	}
+	bufLastNewline = (c == '\n');
+	bufWrCount++;
 	telnetBuf[bufWrIdx++] = c;
 	if (bufWrIdx >= bufLen)
 	{
@@ -866,6 +2011,12 @@ void TelnetSpy::addTelnetBuf(char c)
 	}
 	bufUsed++;
 	bufLeftToSend++;
+#ifdef TELNETSPY_SYSLOG
+	if (syslogUdp)
+	{
+		sysLeftToSend++;
+	}
+#endif
 	CRITCAL_SECTION_END
 #else
 	CRITCAL_SECTION_START
@@ -893,6 +2044,7 @@ void TelnetSpy::addTelnetBuf(char c)
 
 void TelnetSpy::removeOldestLine()
 {
+	TELNETSPY_TRACE_BEGIN(TRACE_EVICT)
 	char c;
 	while (bufUsed > 0)
 	{						 // only if buffer has data
@@ -906,6 +2058,136 @@ void TelnetSpy::removeOldestLine()
 	{
 		pullTelnetBuf(); // remove a possible CR (not normal, should be CR/LF usually!)
 	}
+	TELNETSPY_TRACE_END(TRACE_EVICT)
+}
+
+// Makes room for "c" in a full buffer, returns true if it is dropped instead
+// (then the rest of its line too). "state" is kept per producer.
+bool TelnetSpy::dropByte(uint8_t &state, char c, bool mayBlock)
+{
+#ifdef RLJ_SPY_MODS
+	if ((state == STORE_CUT) && (bufLen - bufUsed < 2) && !makeRoom(mayBlock))
+	{
+		state = DROP_CUT; // no room for the line end of the cut line
+	}
+	else if ((state == STORE_LINE) && (bufUsed == bufLen) && !makeRoom(mayBlock))
+	{
+		state = (telnetBuf[(bufWrIdx ? bufWrIdx : bufLen) - 1] == '\n') ? DROP_LINE : DROP_CUT;
+	}
+	if ((state == DROP_LINE) || (state == DROP_CUT))
+	{
+		if (c == '\n')
+		{
+			state = (state == DROP_CUT) ? STORE_CUT : STORE_LINE;
+		}
+		return true;
+	}
+	if ((state == STORE_CUT) && (bufLen - bufUsed >= 2))
+	{
+		addTelnetBuf('\n'); // end the start of the line stored before
+		state = STORE_LINE;
+	}
+#else
+	if (bufUsed == bufLen)
+	{
+		char c;
+		while (bufUsed > 0)
+		{
+			c = pullTelnetBuf();
+			if (c == '\n')
+			{
+				break;
+			}
+		}
+		if (peekTelnetBuf() == '\r')
+		{
+			pullTelnetBuf();
+		}
+	}
+#endif
+	return false;
+}
+
+// Makes room in the full buffer according to the overflow policy, false: drop the new line
+bool TelnetSpy::makeRoom(bool mayBlock)
+{
+	switch (overflow)
+	{
+	case OVERFLOW_DROP_NEWEST:
+		if (!isOldestLineSent())
+		{
+			return false;
+		}
+		break;
+	case OVERFLOW_BLOCK:
+		if (mayBlock && client.connected())
+		{
+			unsigned long start = millis();
+			while (!isOldestLineSent() && client.connected() && ((millis() - start) < overflowTimeout))
+			{
+#ifndef ESP8266
+				if (taskOwnsClient())
+				{
+					notifyTask();
+					delay(1);
+					continue;
+				}
+#endif
+				sendBlock();
+				if (!isOldestLineSent())
+				{
+					delay(1); // let the network stack take the data
+				}
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	removeOldestLine();
+	return true;
+}
+
+bool TelnetSpy::isOldestLineSent()
+{
+	CRITCAL_SECTION_START
+	uint16_t sent = bufUsed - min(bufLeftToSend, bufUsed);
+	uint16_t idx = bufRdIdxStart;
+	bool found = false;
+	for (uint16_t i = 0; i < sent; i++)
+	{
+		if (telnetBuf[idx] == '\n')
+		{
+			found = true;
+			break;
+		}
+		if (++idx >= bufLen)
+		{
+			idx = 0;
+		}
+	}
+	CRITCAL_SECTION_END
+	return found;
+}
+
+void TelnetSpy::setOverflowPolicy(overflowPolicy policy, uint16_t timeout)
+{
+	overflow = policy;
+	overflowTimeout = timeout;
+}
+
+TelnetSpy::overflowPolicy TelnetSpy::getOverflowPolicy()
+{
+	return overflow;
+}
+
+size_t TelnetSpy::write(const uint8_t *buffer, size_t size, overflowPolicy policy)
+{
+	overflowPolicy previous = overflow;
+	overflow = policy;
+	size_t written = write(buffer, size);
+	overflow = previous;
+	return written;
 }
 
 char TelnetSpy::pullTelnetBuf()
@@ -921,6 +2203,26 @@ char TelnetSpy::pullTelnetBuf()
 	{
 		bufRdIdxStart = 0;
 	}
+	if (bufLeftToSend >= bufUsed)
+	{
+		// not sent to the client yet, but it is gone
+		if (!sendLineStart && !sendSkipLine)
+		{
+			sendCut = true; // the client got the start of the line only
+		}
+		bufLeftToSend = bufUsed - 1;
+		bufRdIdx = bufRdIdxStart;
+		sendLineStart = true;
+		sendSkipLine = false;
+	}
+#ifdef TELNETSPY_SYSLOG
+	if (sysLeftToSend >= bufUsed)
+	{
+		// not sent to the collector yet, but it is gone
+		sysLeftToSend = bufUsed - 1;
+		sysRdIdx = bufRdIdxStart;
+	}
+#endif
 #else
 	char c = telnetBuf[bufRdIdx++];
 	if (bufRdIdx >= bufLen)
@@ -951,7 +2253,10 @@ char TelnetSpy::peekTelnetBuf()
 
 int TelnetSpy::telnetAvailable()
 {
-	checkReceive();
+	if (!taskOwnsClient())
+	{
+		checkReceive();
+	}
 	if (recBuf)
 	{
 		return recUsed;
@@ -961,313 +2266,1299 @@ int TelnetSpy::telnetAvailable()
 
 bool TelnetSpy::isClientConnected()
 {
+	if (channelHost)
+	{
+		return channelHost->connected;
+	}
 	return connected;
 }
 
-void TelnetSpy::setCallbackOnConnect(void (*callback)())
+TelnetSpySink::TelnetSpySink()
 {
-	callbackConnect = callback;
+	nextSink = NULL;
+	pos = 0;
+	holdoff = 0;
+	minBlockSize = TELNETSPY_MIN_BLOCK_SIZE;
+	collectingTime = TELNETSPY_COLLECTING_TIME;
+	maxLevel = TELNETSPY_LEVEL_VERBOSE;
+	lineStart = true;
+	skipLine = false;
 }
 
-void TelnetSpy::setCallbackOnDisconnect(void (*callback)())
+void TelnetSpySink::setMinBlockSize(uint16_t minSize)
 {
-	callbackDisconnect = callback;
+	minBlockSize = max(minSize, (uint16_t)1);
 }
 
-void TelnetSpy::disconnectClient()
+void TelnetSpySink::setCollectingTime(uint16_t colTime)
 {
-	if (client.connected())
-	{
-		sendBlock();
-		client.flush();
-		client.stop();
-	}
-	if (connected && (callbackDisconnect != NULL))
-	{
-		callbackDisconnect();
-	}
-	connected = false;
+	collectingTime = colTime;
 }
 
-void TelnetSpy::clearBuffer()
+void TelnetSpySink::setLevel(uint8_t level)
 {
-	bufUsed = 0;
-	bufRdIdx = 0;
-	bufWrIdx = 0;
-#ifdef RLJ_SPY_MODS
-	bufRdIdxStart = 0;
-#endif
+	maxLevel = level;
 }
 
-void TelnetSpy::setFilter(char ch, const char *msg, void (*callback)())
+uint8_t TelnetSpySink::getLevel()
 {
-	filterChar = ch;
-	if (filterMsg)
-	{
-		free(filterMsg);
-	}
-	filterMsg = strdup(msg);
-	filterCallback = callback;
+	return maxLevel;
 }
 
-void TelnetSpy::setFilter(char ch, const String &msg, void (*callback)())
+bool TelnetSpy::addSink(TelnetSpySink &sink, bool history)
 {
-	filterChar = ch;
-	if (filterMsg)
+	for (TelnetSpySink *s = sinks; s; s = s->nextSink)
 	{
-		free(filterMsg);
+		if (s == &sink)
+		{
+			return false;
+		}
 	}
-	filterMsg = strdup(msg.c_str());
-	filterCallback = callback;
-}
-
-char TelnetSpy::getFilter()
-{
-	return filterChar;
-}
-
-void TelnetSpy::setCallbackOnNvtBRK(void (*callback)())
-{
-	callbackNvtBRK = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtIP(void (*callback)())
-{
-	callbackNvtIP = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtAO(void (*callback)())
-{
-	callbackNvtAO = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtAYT(void (*callback)())
-{
-	callbackNvtAYT = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtEC(void (*callback)())
-{
-	callbackNvtEC = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtEL(void (*callback)())
-{
-	callbackNvtEL = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtGA(void (*callback)())
-{
-	callbackNvtGA = callback;
-}
-
-void TelnetSpy::setCallbackOnNvtWWDD(void (*callback)(char command, char option))
-{
-	callbackNvtWWDD = callback;
+	CRITCAL_SECTION_START
+	sink.pos = history ? (bufWrCount - bufUsed) : bufWrCount;
+	CRITCAL_SECTION_END
+	sink.lineStart = true;
+	sink.holdoff = 0;
+	sink.nextSink = sinks;
+	sinks = &sink;
+	return true;
 }
 
-bool TelnetSpy::enabled()
+void TelnetSpy::removeSink(TelnetSpySink &sink)
 {
-	return isEnabled;
+	for (TelnetSpySink **s = &sinks; *s; s = &(*s)->nextSink)
+	{
+		if (*s == &sink)
+		{
+			*s = sink.nextSink;
+			sink.nextSink = NULL;
+			return;
+		}
+	}
 }
 
-void TelnetSpy::toggle(bool enable)
+// Level of the line starting at "linePos" ("[E]..." of the Arduino core,
+// optionally after a "[  1234]" time stamp, or "E (..." of the IDF). -1 if
+// there is not enough data yet to decide. If "tag" is given, it gets the file
+// name ("[E][file.cpp:12] ...") or the tag ("E (123) tag: ..."), or an empty
+// string if there is none.
+int TelnetSpy::lineLevel(uint32_t linePos, bool force, char *tag, uint8_t tagSize)
 {
-	if (isEnabled && !enable)
+	char head[TELNETSPY_TAG_SCAN];
+	uint8_t want = tag ? sizeof(head) : 3;
+	uint8_t len = 0;
+	CRITCAL_SECTION_START
+	uint32_t oldest = bufWrCount - bufUsed;
+	if ((linePos - oldest) <= bufUsed) // else the line is not in the buffer anymore
 	{
-		if (listening)
+		while ((len < want) && ((linePos + len) != bufWrCount))
 		{
-			if (client.connected())
+			head[len] = telnetBuf[(bufRdIdxStart + (linePos + len - oldest)) % bufLen];
+			if (head[len++] == '\n')
 			{
-				sendBlock();
-				client.flush();
-				client.stop();
+				break;
 			}
-			if (connected && (callbackDisconnect != NULL))
+			if ((len == 2) && (head[0] == '[') && ((head[1] == ' ') || isdigit(head[1])))
 			{
-				callbackDisconnect();
+				want = sizeof(head); // the level follows the time stamp
 			}
-			connected = false;
-			listening = false;
-			telnetServer->close();
-			delete telnetServer;
-			isEnabled = false;
 		}
 	}
-	else if (!isEnabled && enable)
+	else
 	{
-		isEnabled = true;
-		handle(); // handle() will reconnect server
+		force = true;
 	}
-}
-
-void TelnetSpy::handle()
-{
-	if (firstMainLoop)
+	CRITCAL_SECTION_END
+	if ((len < want) && !force && ((len == 0) || (head[len - 1] != '\n')))
 	{
-		firstMainLoop = false;
-		// Between setup() and loop() the configuration for os_print may be changed so it must be renewed
-		if (debugOutput && (actualObject == this))
-		{
-			setDebugOutput(true);
-		}
+		return -1;
 	}
-	if (!started)
+	char level = 0;
+	uint8_t tagStart = 0;
+	uint8_t start = 0;
+	if ((len >= 3) && (head[0] == '[') && ((head[1] == ' ') || isdigit(head[1])))
 	{
-		return;
+		// skip the "[  1234]" time stamp of the Arduino core
+		start = 1;
+		while ((start < len) && ((head[start] == ' ') || isdigit(head[start])))
+		{
+			start++;
+		}
+		start = ((start < len) && (head[start] == ']')) ? start + 1 : 0;
 	}
-	if (!listening)
+	if ((len >= start + 3) && (head[start] == '[') && (head[start + 2] == ']'))
 	{
-		switch (WiFi.getMode())
+		level = head[start + 1];
+		if ((len > start + 4) && (head[start + 3] == '['))
 		{
-		case WIFI_MODE_STA:
-			if (WiFi.status() != WL_CONNECTED)
-			{
-				return;
-			}
-			break;
-		case WIFI_MODE_AP:
-		case WIFI_MODE_APSTA:
-			break;
-		default:
-			return;
+			tagStart = start + 4;
 		}
-		telnetServer = new WiFiServer(port);
-		telnetServer->begin();
-		telnetServer->setNoDelay(bufLen > 0);
-		listening = true;
 	}
-	if (telnetServer->hasClient())
+	else if ((len >= 3) && (head[1] == ' ') && (head[2] == '('))
 	{
-		if (client.connected())
+		level = head[0];
+		for (uint8_t i = 3; i < (len - 1); i++)
 		{
-#if defined ESP8266
-			WiFiClient rejectClient = telnetServer->accept();
-#else
-			WiFiClient rejectClient = telnetServer->available();
-#endif
-			if (strlen(rejectMsg) > 0)
+			if ((head[i] == ')') && (head[i + 1] == ' '))
 			{
-				rejectClient.write((const uint8_t *)rejectMsg, strlen(rejectMsg));
+				tagStart = i + 2;
+				break;
 			}
-			rejectClient.flush();
-			rejectClient.stop();
 		}
-		else
+	}
+	if (tag)
+	{
+		tag[0] = 0;
+		for (uint8_t i = tagStart; tagStart && (i < len); i++)
 		{
-#if defined ESP8266
-			client = telnetServer->accept();
-#else
-			client = telnetServer->available();
-#endif
-			if (strlen(welcomeMsg) > 0)
+			if ((head[i] == ':') || (head[i] == ']'))
 			{
-				client.write((const uint8_t *)welcomeMsg, strlen(welcomeMsg));
+				uint8_t tagLen = min((uint8_t)(i - tagStart), (uint8_t)(tagSize - 1));
+				memcpy(tag, &head[tagStart], tagLen);
+				tag[tagLen] = 0;
+				break;
 			}
-#ifdef RLJ_SPY_MODS
-			// reset bufRdIdx to replay as much as we hold
-			CRITCAL_SECTION_START
-			bufRdIdx = bufRdIdxStart;
-			bufLeftToSend = bufUsed;
-			CRITCAL_SECTION_END
-
-#endif
 		}
 	}
+	switch (level)
+	{
+	case 'E':
+		return TELNETSPY_LEVEL_ERROR;
+	case 'W':
+		return TELNETSPY_LEVEL_WARN;
+	case 'I':
+		return TELNETSPY_LEVEL_INFO;
+	case 'D':
+		return TELNETSPY_LEVEL_DEBUG;
+	case 'V':
+		return TELNETSPY_LEVEL_VERBOSE;
+	default:
+		return TELNETSPY_LEVEL_NONE;
+	}
+}
 
-#ifdef RLJ_SPY_MODS
-	if (client.connected())
+// Offers the new data to a sink, returns the time until it is due again
+uint32_t TelnetSpy::feedSink(TelnetSpySink *sink)
+{
+	CRITCAL_SECTION_START
+	uint32_t left = bufWrCount - sink->pos;
+	uint16_t used = bufUsed;
+	CRITCAL_SECTION_END
+	if (left > used)
 	{
-		if (!connected)
+		// the oldest data was removed before the sink could take it
+		sink->lost(left - used);
+		sink->pos += left - used;
+		sink->lineStart = true;
+		left = used;
+	}
+	if (left == 0)
+	{
+		return TELNETSPY_NO_DEADLINE;
+	}
+	bool due = !isHoldoff(sink->holdoff);
+	if ((left < sink->minBlockSize) && !due)
+	{
+		return holdoffLeft(sink->holdoff);
+	}
+	while (left > 0)
+	{
+		CRITCAL_SECTION_START
+		uint16_t idx = (bufRdIdxStart + (sink->pos - (bufWrCount - bufUsed))) % bufLen;
+		CRITCAL_SECTION_END
+		uint16_t run = min(left, (uint32_t)(bufLen - idx));
+		bool lineEnd = false;
+		// a line being skipped is finished even if the level was raised meanwhile
+		if ((sink->maxLevel < TELNETSPY_LEVEL_VERBOSE) || sink->skipLine)
 		{
-			connected = true;
-			if (pingTime != 0)
+			if (sink->lineStart)
 			{
-				setHoldoff(pingHoldoff, pingTime);
+				int level = lineLevel(sink->pos, due);
+				if (level < 0)
+				{
+					break;
+				}
+				sink->skipLine = level > sink->maxLevel;
+				sink->lineStart = false;
 			}
-			if (callbackConnect != NULL)
+			const char *nl = (const char *)memchr(&telnetBuf[idx], '\n', run);
+			if (nl)
 			{
-				callbackConnect();
+				run = nl - &telnetBuf[idx] + 1;
+				lineEnd = true;
 			}
 		}
+		size_t taken = sink->skipLine ? run : sink->consume(&telnetBuf[idx], run);
+		sink->pos += taken;
+		left -= taken;
+		if (taken < run)
+		{
+			break; // the sink is busy
+		}
+		sink->lineStart = lineEnd;
 	}
-	else
+	setHoldoff(sink->holdoff, sink->collectingTime);
+	return (left > 0) ? sink->collectingTime : TELNETSPY_NO_DEADLINE;
+}
+
+// Length of the part at "idx" which is sent or skipped ("skip") as a whole,
+// consecutive lines with the same result are combined. 0 => wait for more data.
+uint16_t TelnetSpy::filterRun(uint16_t idx, uint16_t len, bool &skip)
+{
+	CRITCAL_SECTION_START
+	uint32_t pos = bufWrCount - bufLeftToSend;
+	CRITCAL_SECTION_END
+	bool force = !isHoldoff(waitHoldoff);
+	uint16_t done = 0;
+	skip = sendSkipLine;
+	while (done < len)
 	{
-		if (connected)
+		if (sendLineStart)
 		{
-			connected = false;
-			sendBlock();
-			client.flush();
-			client.stop();
-			pingHoldoff = 0;
-			setHoldoff(waitHoldoff, collectingTime);
-			if (callbackDisconnect != NULL)
+			int lineSkip = skipLine(pos + done, force);
+			if (lineSkip < 0)
 			{
-				callbackDisconnect();
+				break;
+			}
+			// decided once per line, also if it is sent next time
+			sendSkipLine = lineSkip;
+			sendLineStart = false;
+			if ((done > 0) && (sendSkipLine != skip))
+			{
+				break;
 			}
+			skip = sendSkipLine;
 		}
+		const char *nl = (const char *)memchr(&telnetBuf[idx + done], '\n', len - done);
+		if (!nl)
+		{
+			done = len;
+			break;
+		}
+		done = nl - &telnetBuf[idx] + 1;
+		sendLineStart = true;
 	}
+	return done;
+}
 
-	if (client.connected() && (bufLeftToSend > 0))
+// 1 if the line at "linePos" is not sent to the client, 0 if it is sent, -1 to wait for more data
+int TelnetSpy::skipLine(uint32_t linePos, bool force)
+{
+	char tag[TELNETSPY_TAGS_LEN];
+	int level = lineLevel(linePos, force, clientTags[0] ? tag : NULL, sizeof(tag));
+	if (level < 0)
+	{
+		return -1;
+	}
+	bool lineSkip = (level > clientLevel) || (clientTags[0] && tag[0] && !isTagAllowed(tag));
+	if (grep && !lineSkip)
 	{
-		if (bufLeftToSend >= minBlockSize)
+		int match = grepLine(linePos, force);
+		if (match < 0)
 		{
-			sendBlock();
+			return -1;
 		}
-		else
+		if (match)
 		{
-			if (!isHoldoff(waitHoldoff))
-			{
-				sendBlock();
-				setHoldoff(waitHoldoff, collectingTime);
-			}
+			grepContextLeft = grepAfter;
 		}
-	}
-
-	if (client.connected() && pingTime != 0 && !isHoldoff(pingHoldoff))
-	{
-		CRITCAL_SECTION_START
-		// avoid tainting telnet buffer with pings, use extra OOB buffer
-		if (nvtDetected)
+		else if (grepContextLeft > 0)
 		{
-			// Send a NOP via telnet NVT protocol (out of bounds)
-			NVT[0] = 241;
-			NVT[1] = 255;
-			NVTidx = 2;
+			grepContextLeft--; // context line after a match
 		}
 		else
 		{
-			// Send a NULL
-			NVT[0] = 0;
-			NVTidx = 1;
+			lineSkip = true;
 		}
-		CRITCAL_SECTION_END
-#ifdef DEBUG_TENETSPY
-		TELNETSPY_SERIALPORT.println("telnet NOP"); // DEBUG directly to serial port, always
-#endif
-		sendBlock();
 	}
-#else
-	if (client.connected())
+	return lineSkip;
+}
+
+bool TelnetSpy::isTagAllowed(const char *tag)
+{
+	size_t tagLen = strlen(tag);
+	const char *entry = clientTags;
+	while (*entry)
 	{
-		if (!connected)
+		const char *end = strchr(entry, ',');
+		size_t entryLen = end ? (size_t)(end - entry) : strlen(entry);
+		if ((entryLen == tagLen) && (strncmp(entry, tag, tagLen) == 0))
 		{
-			connected = true;
-			if (pingTime != 0)
-			{
-				pingRef = (millis() & 0x7FFFFFF) + pingTime;
-			}
-			if (callbackConnect != NULL)
-			{
-				callbackConnect();
-			}
+			return true;
 		}
-	}
-	else
-	{
-		if (connected)
+		if (!end)
 		{
-			connected = false;
+			break;
+		}
+		entry = end + 1;
+	}
+	return false;
+}
+
+void TelnetSpy::setClientLevel(uint8_t level)
+{
+	clientLevel = level;
+}
+
+uint8_t TelnetSpy::getClientLevel()
+{
+	return clientLevel;
+}
+
+void TelnetSpy::setClientTags(const char *tags)
+{
+	strncpy(clientTags, tags ? tags : "", sizeof(clientTags) - 1);
+	clientTags[sizeof(clientTags) - 1] = 0;
+}
+
+const char *TelnetSpy::getClientTags()
+{
+	return clientTags;
+}
+
+bool TelnetSpy::addChannel(TelnetSpy &channel, uint8_t id)
+{
+	if ((id == 0) || (id == 255) || (&channel == this) || channel.channelHost || channel.channels || channel.listening || channelHost)
+	{
+		return false;
+	}
+	for (TelnetSpy *ch = channels; ch; ch = ch->nextChannel)
+	{
+		if (ch->channelId == id)
+		{
+			return false;
+		}
+	}
+	channel.channelId = id;
+	channel.nextChannel = channels;
+	channel.channelHost = this;
+	if (connected)
+	{
+		channel.replayBuffer();
+	}
+	channels = &channel;
+	return true;
+}
+
+void TelnetSpy::removeChannel(TelnetSpy &channel)
+{
+	for (TelnetSpy **ch = &channels; *ch; ch = &(*ch)->nextChannel)
+	{
+		if (*ch == &channel)
+		{
+			*ch = channel.nextChannel;
+			if (activeChannel == channel.channelId)
+			{
+				activeChannel = 0;
+			}
+			channel.nextChannel = NULL;
+			channel.channelHost = NULL;
+			channel.channelId = 0;
+			return;
+		}
+	}
+}
+
+uint8_t TelnetSpy::getChannel()
+{
+	return channelId;
+}
+
+// Tells the client which channel the following data belongs to
+void TelnetSpy::selectChannel(uint8_t id)
+{
+	if (id == activeChannel)
+	{
+		return;
+	}
+	uint8_t marker[] = {255, 250, TELNETSPY_CHANNEL_OPTION, id, 255, 240}; // IAC SB option id IAC SE
+	transmit(marker, sizeof(marker));
+	activeChannel = id;
+}
+
+// Time index of the buffer: line starts noted at least "gap" ms apart
+struct TelnetSpyReplayMarks
+{
+	uint32_t pos[TELNETSPY_REPLAY_MARKS]; // counted like "bufWrCount"
+	uint32_t time[TELNETSPY_REPLAY_MARKS];
+	uint32_t gap;
+	uint8_t wrIdx;
+	uint8_t used;
+};
+
+void TelnetSpy::setReplay(uint16_t lines, uint16_t seconds)
+{
+	replayLines = lines;
+	replaySeconds = seconds;
+	if (!seconds)
+	{
+		if (replayMarks)
+		{
+			CRITCAL_SECTION_START
+			TelnetSpyReplayMarks *m = replayMarks;
+			replayMarks = NULL;
+			CRITCAL_SECTION_END
+			free(m);
+		}
+		return;
+	}
+	if (!replayMarks)
+	{
+		TelnetSpyReplayMarks *m = (TelnetSpyReplayMarks *)calloc(1, sizeof(TelnetSpyReplayMarks));
+		if (!m)
+		{
+			return; // the replay is limited by the lines only
+		}
+		m->gap = (uint32_t)seconds * 1000 / (TELNETSPY_REPLAY_MARKS / 2); // the marks cover twice the window
+		replayMarks = m;
+	}
+	else
+	{
+		replayMarks->gap = (uint32_t)seconds * 1000 / (TELNETSPY_REPLAY_MARKS / 2);
+	}
+}
+
+// Notes the start of a line in the time index (called when it is stored)
+void TelnetSpy::markLine()
+{
+	TelnetSpyReplayMarks *m = replayMarks;
+	uint32_t now = millis();
+	if (m->used && ((now - m->time[(m->wrIdx + TELNETSPY_REPLAY_MARKS - 1) % TELNETSPY_REPLAY_MARKS]) < m->gap))
+	{
+		return;
+	}
+	m->pos[m->wrIdx] = bufWrCount;
+	m->time[m->wrIdx] = now;
+	m->wrIdx = (m->wrIdx + 1) % TELNETSPY_REPLAY_MARKS;
+	if (m->used < TELNETSPY_REPLAY_MARKS)
+	{
+		m->used++;
+	}
+}
+
+void TelnetSpy::replayBuffer()
+{
+	replayWindow(replayLines, replaySeconds);
+}
+
+// Sets the send cursor to the start of the last "lines" lines / "seconds" seconds (0: all)
+void TelnetSpy::replayWindow(uint16_t lines, uint16_t seconds)
+{
+#ifdef RLJ_SPY_MODS
+	CRITCAL_SECTION_START
+	uint32_t oldest = bufWrCount - bufUsed;
+	uint32_t start = oldest;
+	if (lines)
+	{
+		// backwards to the line end before the last "lines" lines
+		uint16_t idx = bufWrIdx;
+		for (uint16_t back = 0; back < bufUsed; back++)
+		{
+			idx = idx ? idx - 1 : bufLen - 1;
+			if ((telnetBuf[idx] == '\n') && back && (--lines == 0))
+			{
+				start = bufWrCount - back;
+				break;
+			}
+		}
+	}
+	if (seconds && replayMarks)
+	{
+		// the newest mark before the window, the marks are line starts
+		TelnetSpyReplayMarks *m = replayMarks;
+		uint32_t since = millis() - (uint32_t)seconds * 1000;
+		for (uint8_t i = m->used; i > 0; i--)
+		{
+			uint8_t idx = (m->wrIdx + TELNETSPY_REPLAY_MARKS - i) % TELNETSPY_REPLAY_MARKS;
+			if ((int32_t)(m->time[idx] - since) > 0)
+			{
+				break;
+			}
+			if ((int32_t)(m->pos[idx] - start) > 0)
+			{
+				start = m->pos[idx];
+			}
+		}
+	}
+	bufRdIdx = bufLen ? (bufRdIdxStart + (start - oldest)) % bufLen : 0;
+	bufLeftToSend = bufWrCount - start;
+	sendLineStart = true;
+	sendSkipLine = false;
+	sendCut = false;
+#ifdef TELNETSPY_LATENCY_STATS
+	clearLatencyStamps();
+#endif
+	CRITCAL_SECTION_END
+#endif
+}
+
+void TelnetSpy::setCallbackOnConnect(void (*callback)())
+{
+	callbackConnect = callback;
+}
+
+void TelnetSpy::setCallbackOnDisconnect(void (*callback)())
+{
+	callbackDisconnect = callback;
+}
+
+void TelnetSpy::disconnectClient()
+{
+	if (passToTask(TASK_DISCONNECT))
+	{
+		return;
+	}
+	if (client.connected())
+	{
+		sendBlock();
+		client.flush();
+		client.stop();
+	}
+	if (connected && (callbackDisconnect != NULL))
+	{
+		callbackDisconnect();
+	}
+	connected = false;
+}
+
+void TelnetSpy::clearBuffer()
+{
+	bufReserved = 0;
+	bufUsed = 0;
+	bufRdIdx = 0;
+	bufWrIdx = 0;
+#ifdef RLJ_SPY_MODS
+	bufRdIdxStart = 0;
+#endif
+#ifdef TELNETSPY_SYSLOG
+	sysRdIdx = 0;
+	sysLeftToSend = 0;
+#endif
+#ifdef TELNETSPY_LATENCY_STATS
+	clearLatencyStamps();
+#endif
+}
+
+size_t TelnetSpy::exportBuffer(Print &out)
+{
+	if (!telnetBuf)
+	{
+		return 0;
+	}
+	char chunk[TELNETSPY_EXPORT_CHUNK];
+	size_t exported = 0;
+	CRITCAL_SECTION_START
+	uint32_t pos = bufWrCount - bufUsed;
+	uint32_t end = bufWrCount; // later data is not part of the snapshot
+	CRITCAL_SECTION_END
+	while (pos != end)
+	{
+		uint32_t lost = 0;
+		uint16_t len = 0;
+		// the buffer may be resized or released between the chunks (e.g. by
+		// the background task), the positions are counted like "bufWrCount"
+		CRITCAL_SECTION_START
+		uint32_t oldest = bufWrCount - bufUsed;
+		if ((int32_t)(pos - oldest) < 0)
+		{
+			// evicted meanwhile, continue with the oldest line left
+			lost = min(oldest, end) - pos;
+			pos = min(oldest, end);
+		}
+		if (telnetBuf && bufLen && ((bufWrCount - pos) <= bufUsed))
+		{
+			len = min(end - pos, (uint32_t)sizeof(chunk));
+			uint16_t idx = (bufRdIdxStart + (pos - oldest)) % bufLen;
+			uint16_t first = min(len, (uint16_t)(bufLen - idx));
+			memcpy(chunk, &telnetBuf[idx], first);
+			memcpy(chunk + first, telnetBuf, len - first);
+		}
+		CRITCAL_SECTION_END
+		if (lost)
+		{
+			char msg[48];
+			int msgLen = snprintf(msg, sizeof(msg), "\r\nTelnetSpy: %lu bytes lost\r\n", (unsigned long)lost);
+			out.write((const uint8_t *)msg, msgLen);
+		}
+		if (len == 0)
+		{
+			break;
+		}
+		exported += out.write((const uint8_t *)chunk, len);
+		pos += len;
+	}
+	return exported;
+}
+
+void TelnetSpy::setFilter(char ch, const char *msg, void (*callback)())
+{
+	filterChar = ch;
+	if (filterMsg)
+	{
+		free(filterMsg);
+	}
+	filterMsg = strdup(msg);
+	filterCallback = callback;
+}
+
+void TelnetSpy::setFilter(char ch, const String &msg, void (*callback)())
+{
+	filterChar = ch;
+	if (filterMsg)
+	{
+		free(filterMsg);
+	}
+	filterMsg = strdup(msg.c_str());
+	filterCallback = callback;
+}
+
+char TelnetSpy::getFilter()
+{
+	return filterChar;
+}
+
+void TelnetSpy::setCallbackOnNvtBRK(void (*callback)())
+{
+	callbackNvtBRK = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtIP(void (*callback)())
+{
+	callbackNvtIP = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtAO(void (*callback)())
+{
+	callbackNvtAO = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtAYT(void (*callback)())
+{
+	callbackNvtAYT = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtEC(void (*callback)())
+{
+	callbackNvtEC = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtEL(void (*callback)())
+{
+	callbackNvtEL = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtGA(void (*callback)())
+{
+	callbackNvtGA = callback;
+}
+
+void TelnetSpy::setCallbackOnNvtWWDD(void (*callback)(char command, char option))
+{
+	callbackNvtWWDD = callback;
+}
+
+void TelnetSpy::setCommandPrefix(char ch)
+{
+	cmdPrefix = ch;
+	cmdState = 0;
+}
+
+char TelnetSpy::getCommandPrefix()
+{
+	return cmdPrefix;
+}
+
+void TelnetSpy::sendReply(const char *msg)
+{
+	if (client.connected())
+	{
+		selectChannel(0); // replies are no channel data
+		transmit((const uint8_t *)msg, strlen(msg));
+	}
+}
+
+// Argument of "line" if it is the command "name" (alone or followed by a
+// space), else NULL
+static char *TelnetSpy_command(char *line, const char *name)
+{
+	size_t len = strlen(name);
+	if ((strncmp(line, name, len) != 0) || ((line[len] != 0) && (line[len] != ' ')))
+	{
+		return NULL;
+	}
+	line += len;
+	while (*line == ' ')
+	{
+		line++;
+	}
+	return line;
+}
+
+void TelnetSpy::handleCommand()
+{
+	cmdLine[cmdLen] = 0;
+	cmdState = 2;
+	recLineStart = true;
+	char *arg;
+	if (strcmp(cmdLine, "help") == 0)
+	{
+		sendReply("TelnetSpy commands: help level tags grep history");
+#ifdef TELNETSPY_LATENCY_STATS
+		sendReply(" latency");
+#endif
+#ifdef TELNETSPY_TRACE
+		sendReply(" trace");
+#endif
+		sendReply("\r\n");
+	}
+	else if ((arg = TelnetSpy_command(cmdLine, "level")) != NULL)
+	{
+		// "level e|w|i|d|v" or "level 0...5": send lines up to this level only
+		static const char levels[] = "-ewidv";
+		const char *found = *arg ? strchr(levels, tolower(*arg)) : NULL;
+		if ((*arg >= '0') && (*arg <= '5'))
+		{
+			clientLevel = *arg - '0';
+		}
+		else if (found)
+		{
+			clientLevel = found - levels;
+		}
+		char msg[32];
+		snprintf(msg, sizeof(msg), "TelnetSpy level: %c\r\n", levels[min(clientLevel, (uint8_t)TELNETSPY_LEVEL_VERBOSE)]);
+		sendReply(msg);
+	}
+	else if ((arg = TelnetSpy_command(cmdLine, "tags")) != NULL)
+	{
+		// "tags a,b,c": send tagged lines with these tags only, "tags" alone: all
+		setClientTags(arg);
+		sendReply("TelnetSpy tags: ");
+		sendReply(clientTags[0] ? clientTags : "all");
+		sendReply("\r\n");
+	}
+	else if ((arg = TelnetSpy_command(cmdLine, "grep")) != NULL)
+	{
+		// "grep [-A n] a|b|c": send lines containing one of the patterns
+		// (and n lines after them) only, "grep" alone: all lines
+		uint8_t after = 0;
+		if (strncmp(arg, "-A", 2) == 0)
+		{
+			after = (uint8_t)strtoul(&arg[2], &arg, 10);
+			while (*arg == ' ')
+			{
+				arg++;
+			}
+		}
+		sendReply(setGrep(arg, after) ? "TelnetSpy grep: " : "TelnetSpy grep: too many patterns, ");
+		sendReply(grep ? arg : "all");
+		sendReply("\r\n");
+	}
+	else if ((arg = TelnetSpy_command(cmdLine, "history")) != NULL)
+	{
+		// "history [all|<lines>|<seconds>s]": send the (last part of the) buffer again
+		uint16_t lines = 0;
+		uint16_t seconds = 0;
+		if ((*arg >= '0') && (*arg <= '9'))
+		{
+			lines = (uint16_t)strtoul(arg, &arg, 10);
+			if (*arg == 's')
+			{
+				seconds = lines;
+				lines = 0;
+			}
+		}
+		if (seconds && !replayMarks)
+		{
+			sendReply("TelnetSpy history: no time index (see setReplay)\r\n");
+			return;
+		}
+		char msg[48];
+		if (seconds)
+		{
+			snprintf(msg, sizeof(msg), "TelnetSpy history: last %u s\r\n", seconds);
+		}
+		else if (lines)
+		{
+			snprintf(msg, sizeof(msg), "TelnetSpy history: last %u lines\r\n", lines);
+		}
+		else
+		{
+			snprintf(msg, sizeof(msg), "TelnetSpy history: all\r\n");
+		}
+		sendReply(msg);
+		replayWindow(lines, seconds);
+	}
+#ifdef TELNETSPY_LATENCY_STATS
+	else if (strcmp(cmdLine, "latency") == 0)
+	{
+		char msg[128];
+		snprintf(msg, sizeof(msg), "TelnetSpy latency (us): n=%lu p50=%lu p90=%lu p99=%lu max=%lu\r\n",
+				 (unsigned long)latCount, (unsigned long)getLatencyPercentile(50),
+				 (unsigned long)getLatencyPercentile(90), (unsigned long)getLatencyPercentile(99),
+				 (unsigned long)latMax);
+		sendReply(msg);
+	}
+#endif
+#ifdef TELNETSPY_TRACE
+	else if (strcmp(cmdLine, "trace") == 0)
+	{
+		if (client.connected())
+		{
+			TelnetSpyClientPrint out(this);
+			exportTrace(out);
+		}
+	}
+#endif
+	else
+	{
+		sendReply("TelnetSpy: unknown command\r\n");
+	}
+}
+
+#ifdef TELNETSPY_LATENCY_STATS
+uint32_t TelnetSpy::getLatencyPercentile(uint8_t percent)
+{
+	if (latCount == 0)
+	{
+		return 0;
+	}
+	uint32_t rank = ((uint64_t)latCount * min(percent, (uint8_t)100) + 99) / 100;
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+	uint32_t sum = 0;
+	for (uint8_t i = 0; i < TELNETSPY_LATENCY_BUCKETS; i++)
+	{
+		sum += latHist[i];
+		if (sum >= rank)
+		{
+			// Upper bound of the bucket, but never more than the measured maximum
+			return min((uint32_t)((1UL << i) - 1), latMax);
+		}
+	}
+	return latMax;
+}
+
+uint32_t TelnetSpy::getLatencyMax()
+{
+	return latMax;
+}
+
+uint32_t TelnetSpy::getLatencyCount()
+{
+	return latCount;
+}
+
+void TelnetSpy::resetLatencyStats()
+{
+	CRITCAL_SECTION_START
+	memset(latHist, 0, sizeof(latHist));
+	latCount = 0;
+	latMax = 0;
+	CRITCAL_SECTION_END
+}
+
+void TelnetSpy::clearLatencyStamps()
+{
+	latStampRdIdx = 0;
+	latStampUsed = 0;
+}
+
+// Called with a new byte about to be stored: remember when it was written.
+// Not every byte gets a stamp: only the first byte after the buffer has been
+// sent completely and then one byte every TELNETSPY_LATENCY_STAMP_GAP bytes.
+void TelnetSpy::stampLatency()
+{
+	if (!isClientConnected() || (latStampUsed == TELNETSPY_LATENCY_STAMPS))
+	{
+		return;
+	}
+	if (bufLeftToSend && latStampUsed)
+	{
+		uint8_t last = (latStampRdIdx + latStampUsed - 1) % TELNETSPY_LATENCY_STAMPS;
+		if ((bufWrCount - latStampPos[last]) < TELNETSPY_LATENCY_STAMP_GAP)
+		{
+			return;
+		}
+	}
+	uint8_t idx = (latStampRdIdx + latStampUsed) % TELNETSPY_LATENCY_STAMPS;
+	latStampPos[idx] = bufWrCount;
+	latStampTime[idx] = micros();
+	latStampUsed++;
+}
+
+// Called after data has been sent: all stamps of sent bytes go to the histogram
+void TelnetSpy::recordLatency()
+{
+	uint32_t sentPos = bufWrCount - bufLeftToSend;
+	uint32_t now = micros();
+	while (latStampUsed && ((int32_t)(sentPos - latStampPos[latStampRdIdx]) > 0))
+	{
+		uint32_t delay = now - latStampTime[latStampRdIdx];
+		uint8_t bucket = delay ? (32 - __builtin_clz(delay)) : 0;
+		if (bucket >= TELNETSPY_LATENCY_BUCKETS)
+		{
+			bucket = TELNETSPY_LATENCY_BUCKETS - 1;
+		}
+		latHist[bucket]++;
+		latCount++;
+		if (delay > latMax)
+		{
+			latMax = delay;
+		}
+		if (++latStampRdIdx >= TELNETSPY_LATENCY_STAMPS)
+		{
+			latStampRdIdx = 0;
+		}
+		latStampUsed--;
+	}
+}
+#endif
+
+bool TelnetSpy::enabled()
+{
+	return isEnabled;
+}
+
+void TelnetSpy::toggle(bool enable)
+{
+	if (isEnabled && !enable)
+	{
+		if (passToTask(TASK_DISABLE))
+		{
+			return;
+		}
+		if (listening)
+		{
+			if (client.connected())
+			{
+				sendBlock();
+				client.flush();
+				client.stop();
+			}
+			if (connected && (callbackDisconnect != NULL))
+			{
+				callbackDisconnect();
+			}
+			connected = false;
+			listening = false;
+			telnetServer->close();
+			delete telnetServer;
+			isEnabled = false;
+		}
+	}
+	else if (!isEnabled && enable)
+	{
+		isEnabled = true;
+		handle(); // handle() will reconnect server
+	}
+}
+
+// The work on the buffer which does not need the connection (for a channel
+// done by the host), returns the time until it is due again
+uint32_t TelnetSpy::housekeeping()
+{
+	drainCapture();
+	uint32_t next = governors ? governorReport() : TELNETSPY_NO_DEADLINE;
+	if (collapse)
+	{
+		next = min(next, collapseFlush(false));
+	}
+	if (watermarkHigh)
+	{
+		checkWatermarks();
+	}
+	if (adaptMin)
+	{
+		next = min(next, adaptBuffer());
+	}
+	if (idleTime)
+	{
+		next = min(next, releaseIdle());
+	}
+	// local sinks (file, serial, ...) do not depend on WiFi
+	for (TelnetSpySink *sink = sinks; sink; sink = sink->nextSink)
+	{
+		next = min(next, feedSink(sink));
+	}
+	return next;
+}
+
+uint32_t TelnetSpy::handle()
+{
+	if (taskOwnsClient())
+	{
+		return TELNETSPY_NO_DEADLINE; // the background task does the work
+	}
+	TELNETSPY_TRACE_SCOPE(TRACE_HANDLE)
+#ifndef ESP8266
+	if (taskRequests)
+	{
+		doTaskRequests();
+	}
+#endif
+	if (firstMainLoop)
+	{
+		firstMainLoop = false;
+		// Between setup() and loop() the configuration for os_print may be changed so it must be renewed
+		if (debugOutput && getCapture(CAPTURE_OS_PRINT))
+		{
+			setDebugOutput(true);
+		}
+	}
+	if (!started)
+	{
+		return TELNETSPY_NO_DEADLINE;
+	}
+	uint32_t reportNext = housekeeping();
+	if (channelHost)
+	{
+		return reportNext; // the host instance sends our data
+	}
+	for (TelnetSpy *ch = channels; ch; ch = ch->nextChannel)
+	{
+		reportNext = min(reportNext, ch->housekeeping());
+	}
+	if (!listening)
+	{
+		// Asking for the WiFi state is expensive, so it is done every TELNETSPY_WIFI_CHECK ms only
+		if (isHoldoff(wifiHoldoff))
+		{
+			return min(reportNext, holdoffLeft(wifiHoldoff));
+		}
+		setHoldoff(wifiHoldoff, TELNETSPY_WIFI_CHECK);
+		switch (WiFi.getMode())
+		{
+		case WIFI_MODE_STA:
+			if (WiFi.status() != WL_CONNECTED)
+			{
+				return min(reportNext, (uint32_t)TELNETSPY_WIFI_CHECK);
+			}
+			break;
+		case WIFI_MODE_AP:
+		case WIFI_MODE_APSTA:
+			break;
+		default:
+			return min(reportNext, (uint32_t)TELNETSPY_WIFI_CHECK);
+		}
+		telnetServer = new WiFiServer(port);
+		telnetServer->begin();
+		telnetServer->setNoDelay(bufSize > 0);
+		listening = true;
+	}
+	uint32_t next = reportNext;
+#ifdef TELNETSPY_SYSLOG
+	next = min(next, sendSyslog()); // while WiFi is down the lines stay queued in the buffer
+#endif
+	TELNETSPY_TRACE_BEGIN(TRACE_CONNECT)
+	bool isConnected = client.connected();
+	if (telnetServer->hasClient())
+	{
+		if (isConnected)
+		{
+#if defined ESP8266
+			WiFiClient rejectClient = telnetServer->accept();
+#else
+			WiFiClient rejectClient = telnetServer->available();
+#endif
+#ifdef TELNETSPY_WEBSOCKET
+			if (webSocket)
+			{
+				static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+				rejectClient.write((const uint8_t *)busy, sizeof(busy) - 1);
+			}
+			else
+#endif
+				if (strlen(rejectMsg) > 0)
+			{
+				rejectClient.write((const uint8_t *)rejectMsg, strlen(rejectMsg));
+			}
+			rejectClient.flush();
+			rejectClient.stop();
+		}
+		else
+		{
+#if defined ESP8266
+			client = telnetServer->accept();
+#else
+			client = telnetServer->available();
+#endif
+			allocBuffers();
+#ifdef TELNETSPY_WEBSOCKET
+			wsState = webSocket ? WS_HANDSHAKE : WS_OFF;
+			wsLineLen = 0;
+			wsKey[0] = 0;
+			wsHeaders = 0;
+			wsRxHeaderLen = 0;
+			wsRxLeft = 0;
+#endif
+			if ((strlen(welcomeMsg) > 0) && !isWebSocketClient()) // else sent after the handshake
+			{
+				client.write((const uint8_t *)welcomeMsg, strlen(welcomeMsg));
+			}
+			nvtState = NVT_DATA;
+			cmdState = 0;
+			recLineStart = true;
+			// the filter is set by each client
+			clientLevel = TELNETSPY_LEVEL_VERBOSE;
+			clientTags[0] = 0;
+			setGrep(NULL);
+			sendLineStart = true;
+			sendSkipLine = false;
+#ifdef RLJ_SPY_MODS
+			// reset bufRdIdx to replay as much as we hold
+			replayBuffer();
+			activeChannel = 0;
+			for (TelnetSpy *ch = channels; ch; ch = ch->nextChannel)
+			{
+				ch->replayBuffer();
+			}
+#endif
+			isConnected = client.connected();
+		}
+	}
+
+#ifdef RLJ_SPY_MODS
+	if (isConnected && !connected)
+	{
+		connected = true;
+		startNegotiation();
+		if (pingTime != 0)
+		{
+			setHoldoff(pingHoldoff, pingTime);
+		}
+		if (callbackConnect != NULL)
+		{
+			callbackConnect();
+		}
+	}
+	else if (!isConnected && connected)
+	{
+		connected = false;
+		sendBlock();
+		client.flush();
+		client.stop();
+#ifdef TELNETSPY_MCCP
+		mccpActive = false;
+#endif
+		pingHoldoff = 0;
+		setHoldoff(waitHoldoff, collectingTime);
+		if (callbackDisconnect != NULL)
+		{
+			callbackDisconnect();
+		}
+	}
+	TELNETSPY_TRACE_END(TRACE_CONNECT)
+	if (!isConnected)
+	{
+		return next;
+	}
+#ifdef TELNETSPY_WEBSOCKET
+	if (wsState == WS_HANDSHAKE)
+	{
+		checkReceive(); // nothing is sent before the handshake is done
+		return next;
+	}
+#endif
+
+	if (bufLeftToSend > 0)
+	{
+		if ((bufLeftToSend >= minBlockSize) || !isHoldoff(waitHoldoff))
+		{
+			sendBlock();
+		}
+	}
+	for (TelnetSpy *ch = channels; ch; ch = ch->nextChannel)
+	{
+		ch->drainCapture();
+		if ((ch->bufLeftToSend > 0) && ((ch->bufLeftToSend >= ch->minBlockSize) || !ch->isHoldoff(ch->waitHoldoff)))
+		{
+			ch->sendBlock();
+		}
+	}
+
+	if ((pingTime != 0) && !isHoldoff(pingHoldoff))
+	{
+		// avoid tainting telnet buffer with pings, use extra OOB buffer
+#ifdef TELNETSPY_WEBSOCKET
+		if (isWebSocketClient())
+		{
+			wsFrame(9, NULL, 0); // WebSocket ping
+		}
+		else
+#endif
+			if (nvtDetected)
+		{
+			// Send a NOP via telnet NVT protocol (out of bounds)
+			static const uint8_t nop[] = {255, 241};
+			queueOob(nop, sizeof(nop));
+		}
+		else
+		{
+			// Send a NULL
+			static const uint8_t nul = 0;
+			queueOob(&nul, 1);
+		}
+#ifdef DEBUG_TENETSPY
+		TELNETSPY_SERIALPORT.println("telnet NOP"); // DEBUG directly to serial port, always
+#endif
+		sendBlock();
+	}
+
+	checkReceive();
+	if (oobUsed)
+	{
+		sendOob(); // answers of the option negotiation
+	}
+
+	// Time until something has to be done (received data is not foreseeable)
+	if ((bufLeftToSend >= minBlockSize) || oobUsed)
+	{
+		return 0;
+	}
+	if (bufLeftToSend > 0)
+	{
+		next = min(next, holdoffLeft(waitHoldoff));
+	}
+	for (TelnetSpy *ch = channels; ch; ch = ch->nextChannel)
+	{
+		if (ch->bufLeftToSend >= ch->minBlockSize)
+		{
+			return 0;
+		}
+		if (ch->bufLeftToSend > 0)
+		{
+			next = min(next, ch->holdoffLeft(ch->waitHoldoff));
+		}
+	}
+	if (pingTime != 0)
+	{
+		next = min(next, holdoffLeft(pingHoldoff));
+	}
+	return next;
+#else
+	if (client.connected())
+	{
+		if (!connected)
+		{
+			connected = true;
+			startNegotiation();
+			if (pingTime != 0)
+			{
+				pingRef = (millis() & 0x7FFFFFF) + pingTime;
+			}
+			if (callbackConnect != NULL)
+			{
+				callbackConnect();
+			}
+		}
+	}
+	else
+	{
+		if (connected)
+		{
+			connected = false;
 			sendBlock();
 			client.flush();
 			client.stop();
@@ -1275,256 +3566,1844 @@ void TelnetSpy::handle()
 			waitRef = 0xFFFFFFFF;
 			if (callbackDisconnect != NULL)
 			{
-				callbackDisconnect();
+				callbackDisconnect();
+			}
+		}
+	}
+
+	if (client.connected() && (bufUsed > 0))
+	{
+		if (bufUsed >= minBlockSize)
+		{
+			sendBlock();
+		}
+		else
+		{
+			unsigned long m = millis() & 0x7FFFFFF;
+			if (waitRef == 0xFFFFFFFF)
+			{
+				waitRef = m + collectingTime;
+				if (waitRef > 0x7FFFFFFF)
+				{
+					waitRef -= 0x80000000;
+				}
+			}
+			else
+			{
+				if (!((waitRef < 0x20000000) && (m > 0x60000000)) && (m >= waitRef))
+				{
+					sendBlock();
+				}
+			}
+		}
+	}
+	if (client.connected() && (pingRef != 0xFFFFFFFF))
+	{
+		unsigned long m = millis() & 0x7FFFFFF;
+		if (!((pingRef < 0x20000000) && (m > 0x60000000)) && (m >= pingRef))
+		{
+			if (nvtDetected)
+			{
+				// Send a NOP via telnet NVT protocol
+				addTelnetBuf(255);
+				addTelnetBuf(241);
+			}
+			else
+			{
+				// Send a NULL
+				addTelnetBuf(0);
+			}
+			sendBlock();
+		}
+	}
+	if (client.connected())
+	{
+		checkReceive();
+		if (oobUsed)
+		{
+			sendOob(); // answers of the option negotiation
+		}
+	}
+	return 0;
+#endif
+}
+
+// Copies contiguous runs out of the receive buffer. If "terminator" is not -1,
+// copying stops there and the terminator is removed, but not copied.
+size_t TelnetSpy::pullRecBuf(uint8_t *buffer, size_t size, int terminator, bool &found)
+{
+	size_t done = 0;
+	found = false;
+	CRITCAL_SECTION_START
+	while ((done < size) && (recUsed > 0))
+	{
+		size_t run = min(size - done, (size_t)min(recUsed, (uint16_t)(recLen - recRdIdx)));
+		size_t skip = 0;
+		if (terminator != -1)
+		{
+			char *p = (char *)memchr(&recBuf[recRdIdx], terminator, run);
+			if (p)
+			{
+				run = p - &recBuf[recRdIdx];
+				skip = 1;
+				found = true;
+			}
+		}
+		memcpy(&buffer[done], &recBuf[recRdIdx], run);
+		done += run;
+		recRdIdx += run + skip;
+		if (recRdIdx >= recLen)
+		{
+			recRdIdx -= recLen;
+		}
+		recUsed -= run + skip;
+		if (found)
+		{
+			break;
+		}
+	}
+	CRITCAL_SECTION_END
+	return done;
+}
+
+void TelnetSpy::writeRecBuf(char c)
+{
+	if (!recBuf || (recLen == recUsed))
+	{
+		return;
+	}
+	CRITCAL_SECTION_START
+	recBuf[recWrIdx++] = c;
+	if (recWrIdx >= recLen)
+	{
+		recWrIdx = 0;
+	}
+	recUsed++;
+	CRITCAL_SECTION_END
+}
+
+void TelnetSpy::receiveChar(char c)
+{
+	if (cmdState == 1)
+	{
+		// Collecting an in-band command
+		if ((c == '\r') || (c == '\n') || (c == 0))
+		{
+			handleCommand();
+		}
+		else if (cmdLen < (TELNETSPY_CMD_LEN - 1))
+		{
+			cmdLine[cmdLen++] = c;
+		}
+		return;
+	}
+	if (cmdState == 2)
+	{
+		// Swallow the second character of the line end of a command
+		cmdState = 0;
+		if ((c == '\n') || (c == 0))
+		{
+			return;
+		}
+	}
+	if (cmdPrefix && recLineStart && (c == cmdPrefix))
+	{
+		cmdState = 1;
+		cmdLen = 0;
+		return;
+	}
+	recLineStart = (c == '\r') || (c == '\n');
+	writeRecBuf(c);
+}
+
+void TelnetSpy::checkReceive()
+{
+	TELNETSPY_TRACE_SCOPE(TRACE_RECEIVE)
+	if (!recBuf && !isWebSocketClient())
+	{
+		// Without receive buffer normal characters are left in the client buffer
+		// for the app, only the NVT protocol and the filter character are handled
+		int c;
+		while ((c = client.peek()) != -1)
+		{
+			if ((nvtState == NVT_DATA) && (c != 255) && !(filterChar && (filterChar == (char)c)))
+			{
+				return;
+			}
+			client.read();
+			parseReceived(c);
+		}
+		return;
+	}
+	uint8_t buf[TELNETSPY_REC_CHUNK];
+	int n = client.available();
+	while ((n > 0) && client.connected())
+	{
+		int len = client.read(buf, min(n, (int)sizeof(buf)));
+		if (len <= 0)
+		{
+			return;
+		}
+		n -= len;
+		for (int i = 0; i < len; i++)
+		{
+#ifdef TELNETSPY_WEBSOCKET
+			if (isWebSocketClient())
+			{
+				wsReceive(buf[i]);
+				continue;
+			}
+#endif
+			parseReceived(buf[i]);
+		}
+	}
+}
+
+// RFC 854 receive state machine, telegrams may be split across several reads
+void TelnetSpy::parseReceived(uint8_t c)
+{
+	switch (nvtState)
+	{
+	case NVT_DATA:
+		if (filterChar && (filterChar == (char)c))
+		{
+			// Filter character detected
+			if (strlen(filterMsg) > 0)
+			{
+				transmit((const uint8_t *)filterMsg, strlen(filterMsg));
+			}
+			if (filterCallback != NULL)
+			{
+				filterCallback();
+			}
+		}
+		else if ((255 == c) && !isWebSocketClient())
+		{
+			// IAC (start of telnet NVT protocol telegram), a WebSocket payload is plain data
+			nvtState = NVT_IAC;
+		}
+		else
+		{
+			receiveChar(c);
+		}
+		break;
+	case NVT_IAC:
+		nvtState = NVT_DATA;
+		switch (c)
+		{
+		case 241: // Telnet command "NOP" (no operation)
+			if (pingTime != 0)
+			{
+#ifdef RLJ_SPY_MODS
+				setHoldoff(pingHoldoff, pingTime);
+#else
+				pingRef = (millis() & 0x7FFFFFF) + pingTime;
+#endif
+			}
+			break;
+		case 242: // Telnet command "Data Mark" (not yet implemented)
+			break;
+		case 243: // Telnet command "Break";
+			if (callbackNvtBRK != NULL)
+			{
+				callbackNvtBRK();
+			}
+			break;
+		case 244: // Telnet command "Interrupt process"
+			if (callbackNvtIP != NULL)
+			{
+				if ((void (*)())1 == callbackNvtIP)
+				{
+					ESP.restart();
+				}
+				else
+				{
+					callbackNvtIP();
+				}
+			}
+			break;
+		case 245: // Telnet command "Abort output"
+			if (callbackNvtAO != NULL)
+			{
+				if ((void (*)())1 == callbackNvtAO)
+				{
+					disconnectClient();
+				}
+				else
+				{
+					callbackNvtAO();
+				}
+			}
+			break;
+		case 246: // Telnet command "Are you there"
+			if (callbackNvtAYT != NULL)
+			{
+				callbackNvtAYT();
+			}
+			break;
+		case 247: // Telnet command "Erase character"
+			if (callbackNvtEC != NULL)
+			{
+				callbackNvtEC();
+			}
+			break;
+		case 248: // Telnet command "Erase line"
+			if (callbackNvtEL != NULL)
+			{
+				callbackNvtEL();
+			}
+			break;
+		case 249: // Telnet command "Go ahead"
+			if (callbackNvtGA != NULL)
+			{
+				callbackNvtGA();
+			}
+			break;
+		case 250: // Telnet command "SB" (additional data follows up to IAC SE)
+			nvtState = NVT_SB;
+			sbLen = 0;
+			break;
+		case 251: // Telnet command "WILL"
+		case 252: // Telnet command "WON'T"
+		case 253: // Telnet command "DO"
+		case 254: // Telnet command "DON'T"
+			nvtCmd = c;
+			nvtState = NVT_OPTION;
+			break;
+		case 255: // Escaped data byte 0xff
+			receiveChar(c);
+			break;
+		}
+		break;
+	case NVT_OPTION: // Option byte of WILL / WON'T / DO / DON'T
+		nvtState = NVT_DATA;
+		nvtDetected = true;
+		if (negotiation)
+		{
+			negotiate(nvtCmd, c);
+		}
+		if (callbackNvtWWDD != NULL)
+		{
+			callbackNvtWWDD(nvtCmd, c);
+		}
+		break;
+	case NVT_SB: // Subnegotiation data up to IAC SE, only the beginning is stored
+		if (255 == c)
+		{
+			nvtState = NVT_SB_IAC;
+		}
+		else if (sbLen < TELNETSPY_SB_LEN)
+		{
+			sbBuf[sbLen++] = c;
+		}
+		break;
+	case NVT_SB_IAC:
+		if (240 == c)
+		{
+			// SE ends the subnegotiation
+			nvtState = NVT_DATA;
+			if (negotiation)
+			{
+				handleSubnegotiation();
+			}
+			break;
+		}
+		// IAC IAC is an escaped data byte 0xff
+		nvtState = NVT_SB;
+		if ((255 == c) && (sbLen < TELNETSPY_SB_LEN))
+		{
+			sbBuf[sbLen++] = c;
+		}
+		break;
+	}
+}
+
+bool TelnetSpy::queueOob(const uint8_t *data, uint8_t len)
+{
+	bool ok;
+	CRITCAL_SECTION_START
+	ok = (oobUsed + len) <= TELNETSPY_OOB_LEN;
+	if (ok)
+	{
+		memcpy(&oobBuf[oobUsed], data, len);
+		oobUsed += len;
+	}
+	CRITCAL_SECTION_END
+	return ok;
+}
+
+bool TelnetSpy::sendOob()
+{
+	uint8_t data[TELNETSPY_OOB_LEN];
+	CRITCAL_SECTION_START
+	uint8_t len = oobUsed;
+	memcpy(data, oobBuf, len);
+	oobUsed = 0;
+	CRITCAL_SECTION_END
+	if (len)
+	{
+		selectChannel(0); // negotiation is no channel data
+		transmit(data, len);
+	}
+	return len > 0;
+}
+
+void TelnetSpy::setNegotiation(bool enable)
+{
+	negotiation = enable;
+}
+
+bool TelnetSpy::getNegotiation()
+{
+	return negotiation;
+}
+
+uint16_t TelnetSpy::getWindowWidth()
+{
+	return windowWidth;
+}
+
+uint16_t TelnetSpy::getWindowHeight()
+{
+	return windowHeight;
+}
+
+// Telnet options handled by the negotiation (index into nvtOpt)
+static const uint8_t nvtOptions[TELNETSPY_NVT_OPTIONS] = {
+	0,	// BINARY (RFC 856)
+	1,	// ECHO (RFC 857)
+	3,	// SUPPRESS GO AHEAD (RFC 858)
+	31, // NAWS, window size (RFC 1073)
+	34, // LINEMODE (RFC 1184)
+#ifdef TELNETSPY_MCCP
+	86 // COMPRESS2 (MCCP2)
+#endif
+};
+
+int TelnetSpy::nvtOptionIndex(uint8_t option)
+{
+	for (uint8_t i = 0; i < sizeof(nvtOptions); i++)
+	{
+		if (nvtOptions[i] == option)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Decides if an option may be enabled on our side ("local") or the client side
+bool TelnetSpy::nvtAccept(uint8_t option, bool local)
+{
+	switch (option)
+	{
+	case 0: // BINARY: we send binary data only in binary safe mode
+		return local ? binarySafe : true;
+	case 3: // SUPPRESS GO AHEAD: we never send GA
+		return true;
+	case 31: // NAWS
+	case 34: // LINEMODE: the client edits whole lines locally
+		return !local;
+#ifdef TELNETSPY_MCCP
+	case 86: // COMPRESS2: only if the compressor memory is allocated
+		return local && (mccp != NULL);
+#endif
+	default: // ECHO (the client echoes itself) and all unknown options
+		return false;
+	}
+}
+
+void TelnetSpy::queueNvt(uint8_t cmd, uint8_t option)
+{
+	uint8_t data[] = {255, cmd, option};
+	queueOob(data, sizeof(data));
+}
+
+void TelnetSpy::startNegotiation()
+{
+	memset(nvtOpt, 0, sizeof(nvtOpt));
+	windowWidth = 0;
+	windowHeight = 0;
+#ifdef TELNETSPY_MCCP
+	mccpActive = false; // a new client starts uncompressed, whether negotiated or not
+#endif
+	if (!negotiation || isWebSocketClient())
+	{
+		return;
+	}
+	requestOption(253, 34); // DO LINEMODE
+	requestOption(253, 31); // DO NAWS
+#ifdef TELNETSPY_MCCP
+	if (mccp)
+	{
+		requestOption(251, 86); // WILL COMPRESS2
+	}
+#endif
+	if (binarySafe)
+	{
+		requestOption(251, 0); // WILL BINARY
+		requestOption(253, 0); // DO BINARY
+	}
+}
+
+// Asks the client to change an option (Q method of RFC 1143, without queueing)
+void TelnetSpy::requestOption(uint8_t cmd, uint8_t option)
+{
+	int i = nvtOptionIndex(option);
+	if (i < 0)
+	{
+		return;
+	}
+	bool local = (cmd == 251) || (cmd == 252);	// WILL / WON'T
+	bool enable = (cmd == 251) || (cmd == 253); // WILL / DO
+	uint8_t on = local ? NVT_OPT_US : NVT_OPT_HIM;
+	uint8_t pending = local ? NVT_OPT_US_PENDING : NVT_OPT_HIM_PENDING;
+	if ((nvtOpt[i] & pending) || (((nvtOpt[i] & on) != 0) == enable))
+	{
+		return;
+	}
+	queueNvt(cmd, option);
+	nvtOpt[i] |= pending;
+}
+
+// Handles WILL / WON'T / DO / DON'T received from the client. Only real
+// changes of the option state are answered, so there are no endless loops.
+void TelnetSpy::negotiate(uint8_t cmd, uint8_t option)
+{
+	int i = nvtOptionIndex(option);
+	uint8_t state = (i >= 0) ? nvtOpt[i] : 0;
+	bool local = (cmd == 253) || (cmd == 254); // DO / DON'T refer to our side
+	uint8_t on = local ? NVT_OPT_US : NVT_OPT_HIM;
+	uint8_t pending = local ? NVT_OPT_US_PENDING : NVT_OPT_HIM_PENDING;
+	if ((cmd == 251) || (cmd == 253))
+	{
+		// WILL / DO
+		if (state & on)
+		{
+			return;
+		}
+		if ((i >= 0) && nvtAccept(option, local))
+		{
+			if (!(state & pending))
+			{
+				queueNvt(local ? 251 : 253, option);
+			}
+			nvtOpt[i] = (state | on) & ~pending;
+			if (!local && (option == 34))
+			{
+				// LINEMODE: let the client edit the lines and send them complete
+				static const uint8_t mode[] = {255, 250, 34, 1, 1, 255, 240}; // SB LINEMODE MODE EDIT SE
+				queueOob(mode, sizeof(mode));
+			}
+#ifdef TELNETSPY_MCCP
+			if (local && (option == 86))
+			{
+				startCompression();
+			}
+#endif
+		}
+		else
+		{
+			queueNvt(local ? 252 : 254, option);
+			if (i >= 0)
+			{
+				nvtOpt[i] = state & ~pending;
+			}
+		}
+	}
+	else
+	{
+		// WON'T / DON'T
+		if (!(state & (on | pending)))
+		{
+			return;
+		}
+		if (!(state & pending))
+		{
+			queueNvt(local ? 252 : 254, option);
+		}
+		nvtOpt[i] = state & ~(on | pending);
+#ifdef TELNETSPY_MCCP
+		if (local && (option == 86))
+		{
+			stopCompression();
+		}
+#endif
+	}
+}
+
+void TelnetSpy::handleSubnegotiation()
+{
+	if (sbLen == 0)
+	{
+		return;
+	}
+	switch (sbBuf[0])
+	{
+	case 31: // NAWS: width and height as 16 bit values
+		if (sbLen >= 5)
+		{
+			windowWidth = (sbBuf[1] << 8) | sbBuf[2];
+			windowHeight = (sbBuf[3] << 8) | sbBuf[4];
+		}
+		break;
+	case 34: // LINEMODE
+		if ((sbLen >= 3) && (sbBuf[1] == 1) && !(sbBuf[2] & 4))
+		{
+			// MODE without MODE_ACK: acknowledge it
+			uint8_t mode[] = {255, 250, 34, 1, (uint8_t)((sbBuf[2] & 0x1F) | 4), 255, 240};
+			queueOob(mode, sizeof(mode));
+		}
+		else if ((sbLen >= 3) && (sbBuf[1] == 253) && (sbBuf[2] == 2))
+		{
+			// DO FORWARDMASK: not supported
+			static const uint8_t wont[] = {255, 250, 34, 252, 2, 255, 240};
+			queueOob(wont, sizeof(wont));
+		}
+		break;
+	}
+}
+
+#ifndef ESP8266
+static void TelnetSpy_task(void *spy)
+{
+	((TelnetSpy *)spy)->taskLoop();
+}
+
+bool TelnetSpy::startTask(BaseType_t core)
+{
+	if (taskHandle)
+	{
+		return true;
+	}
+	taskStop = false;
+	return xTaskCreatePinnedToCore(TelnetSpy_task, "TelnetSpy", TELNETSPY_TASK_STACK, this,
+								   TELNETSPY_TASK_PRIORITY, &taskHandle, core) == pdPASS;
+}
+
+void TelnetSpy::stopTask()
+{
+	if (!taskHandle || (xTaskGetCurrentTaskHandle() == taskHandle))
+	{
+		return;
+	}
+	taskStop = true;
+	notifyTask();
+	while (taskHandle)
+	{
+		vTaskDelay(1);
+	}
+}
+
+// Wakes up the background task (if it runs)
+void TelnetSpy::notifyTask()
+{
+	CRITCAL_SECTION_START
+	TaskHandle_t task = taskHandle;
+	CRITCAL_SECTION_END
+	if (task)
+	{
+		xTaskNotifyGive(task);
+	}
+}
+
+// Lets the background task do a change of the connection, false if the caller may do it itself
+bool TelnetSpy::passToTask(uint8_t request)
+{
+	if (!taskOwnsClient())
+	{
+		return false;
+	}
+	CRITCAL_SECTION_START
+	taskRequests |= request;
+	CRITCAL_SECTION_END
+	notifyTask();
+	return true;
+}
+
+void TelnetSpy::doTaskRequests()
+{
+	CRITCAL_SECTION_START
+	uint8_t requests = taskRequests;
+	taskRequests = 0;
+	CRITCAL_SECTION_END
+	if (requests & TASK_SET_PORT)
+	{
+		setPort(port);
+	}
+	if (requests & TASK_DISCONNECT)
+	{
+		disconnectClient();
+	}
+	if (requests & TASK_DISABLE)
+	{
+		toggle(false);
+	}
+}
+
+bool TelnetSpy::isTaskRunning()
+{
+	return taskHandle != NULL;
+}
+
+void TelnetSpy::taskLoop()
+{
+	while (!taskStop)
+	{
+		uint32_t next = handle();
+		// Woken up early by write() if a block is ready, received data is polled
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(max(min(next, (uint32_t)TELNETSPY_TASK_PERIOD), (uint32_t)1)));
+	}
+	CRITCAL_SECTION_START
+	taskHandle = NULL; // no notifications from now on
+	CRITCAL_SECTION_END
+	// the memory of a task deleting itself is freed later by the idle task, so a
+	// notification which read the handle just before is still harmless
+	vTaskDelete(NULL);
+}
+#endif
+
+#ifdef RLJ_SPY_MODS
+void TelnetSpy::setHoldoff(unsigned long &holdoff, unsigned long period)
+{
+	holdoff = millis() + period;
+	if (holdoff == 0)
+		holdoff++; // a valid delay must avoid zero!
+}
+
+uint32_t TelnetSpy::holdoffLeft(unsigned long &holdoff)
+{
+	if (!isHoldoff(holdoff))
+	{
+		return 0;
+	}
+	return holdoff - millis();
+}
+
+bool TelnetSpy::isHoldoff(unsigned long &holdoff)
+{
+	if (holdoff)
+	{
+		long tDelta = millis() - holdoff; // signed value performs as required for rollover in any situation
+		if (tDelta >= 0)
+			holdoff = 0;
+	}
+	return holdoff != 0;
+}
+#endif
+
+#ifdef TELNETSPY_TRACE
+void TelnetSpy::traceEvent(uint8_t phase, bool begin)
+{
+	if (tracePaused)
+	{
+		return;
+	}
+	uint32_t t = micros();
+	CRITCAL_SECTION_START
+	traceTime[traceWrIdx] = t;
+	traceType[traceWrIdx] = begin ? (phase | 0x80) : phase;
+	if (++traceWrIdx >= TELNETSPY_TRACE_EVENTS)
+	{
+		traceWrIdx = 0;
+	}
+	if (traceUsed < TELNETSPY_TRACE_EVENTS)
+	{
+		traceUsed++;
+	}
+	CRITCAL_SECTION_END
+}
+
+void TelnetSpy::clearTrace()
+{
+	CRITCAL_SECTION_START
+	traceWrIdx = 0;
+	traceUsed = 0;
+	CRITCAL_SECTION_END
+}
+
+void TelnetSpy::exportTrace(Print &out)
+{
+	// Recording is paused while exporting, so the ring is a consistent snapshot
+	CRITCAL_SECTION_START
+	tracePaused = true;
+	uint16_t count = traceUsed;
+	uint16_t idx = (traceWrIdx + TELNETSPY_TRACE_EVENTS - count) % TELNETSPY_TRACE_EVENTS;
+	CRITCAL_SECTION_END
+	char chunk[256];
+	size_t used = 0;
+	uint32_t first = traceTime[idx];
+	used = snprintf(chunk, sizeof(chunk), "{\"traceEvents\":[");
+	for (uint16_t i = 0; i < count; i++)
+	{
+		if ((sizeof(chunk) - used) < 96)
+		{
+			out.write((const uint8_t *)chunk, used);
+			used = 0;
+		}
+		uint8_t type = traceType[idx];
+		used += snprintf(&chunk[used], sizeof(chunk) - used,
+						 "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu,\"pid\":1,\"tid\":%u}",
+						 i ? "," : "", traceNames[type & 0x7F], (type & 0x80) ? 'B' : 'E',
+						 (unsigned long)(traceTime[idx] - first), (unsigned int)port);
+		if (++idx >= TELNETSPY_TRACE_EVENTS)
+		{
+			idx = 0;
+		}
+	}
+	if ((sizeof(chunk) - used) < 32)
+	{
+		out.write((const uint8_t *)chunk, used);
+		used = 0;
+	}
+	used += snprintf(&chunk[used], sizeof(chunk) - used, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	out.write((const uint8_t *)chunk, used);
+	tracePaused = false;
+}
+#endif
+
+#ifdef TELNETSPY_MCCP
+// Compressor state of MCCP2: a zlib stream using the fixed Huffman codes of
+// deflate (RFC 1951) and a single hash probe into a small window
+struct TelnetSpyDeflate
+{
+	uint8_t window[TELNETSPY_MCCP_WINDOW]; // the last compressed bytes
+	uint16_t head[TELNETSPY_MCCP_HASH];	   // latest position of a 3 byte sequence
+	uint8_t out[TELNETSPY_MCCP_OUT];
+	uint16_t outUsed;
+	uint32_t bits;
+	uint8_t bitCount;
+	uint32_t pos; // number of bytes compressed so far
+	uint32_t adlerA;
+	uint32_t adlerB;
+};
+
+static const uint16_t deflateLenBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t deflateLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t deflateDistBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t deflateDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+bool TelnetSpy::setCompression(bool enable)
+{
+	if (enable && !mccp)
+	{
+		// The whole memory is allocated here, compressing itself never allocates
+		mccp = (TelnetSpyDeflate *)malloc(sizeof(TelnetSpyDeflate));
+		if (!mccp)
+		{
+			return false;
+		}
+		if (connected && negotiation)
+		{
+			requestOption(251, 86); // WILL COMPRESS2
+		}
+	}
+	else if (!enable && mccp)
+	{
+		stopCompression();
+		free(mccp);
+		mccp = NULL;
+	}
+	return true;
+}
+
+bool TelnetSpy::getCompression()
+{
+	return mccp != NULL;
+}
+
+bool TelnetSpy::isCompressing()
+{
+	return mccpActive;
+}
+
+void TelnetSpy::startCompression()
+{
+	if (!mccp || mccpActive)
+	{
+		return;
+	}
+	// Everything before IAC SB COMPRESS2 IAC SE is sent uncompressed
+	sendOob();
+	static const uint8_t sb[] = {255, 250, 86, 255, 240};
+	client.write(sb, sizeof(sb));
+	memset(mccp->head, 0, sizeof(mccp->head));
+	mccp->outUsed = 0;
+	mccp->bits = 0;
+	mccp->bitCount = 0;
+	mccp->pos = 0;
+	mccp->adlerA = 1;
+	mccp->adlerB = 0;
+	mccpActive = true;
+	deflateBits(0x78, 8); // zlib header: deflate, no dictionary
+	deflateBits(0x01, 8);
+}
+
+void TelnetSpy::stopCompression()
+{
+	if (!mccpActive)
+	{
+		return;
+	}
+	// Empty final block, then the Adler-32 checksum ends the zlib stream
+	deflateBits(3, 3);
+	deflateCode(0, 7);
+	if (mccp->bitCount)
+	{
+		deflateBits(0, 8 - mccp->bitCount);
+	}
+	uint32_t adler = (mccp->adlerB << 16) | mccp->adlerA;
+	for (int8_t i = 24; i >= 0; i -= 8)
+	{
+		deflateBits((adler >> i) & 0xFF, 8);
+	}
+	client.write(mccp->out, mccp->outUsed);
+	mccp->outUsed = 0;
+	mccpActive = false;
+}
+
+void TelnetSpy::deflateBits(uint32_t value, uint8_t count)
+{
+	mccp->bits |= value << mccp->bitCount;
+	mccp->bitCount += count;
+	while (mccp->bitCount >= 8)
+	{
+		mccp->out[mccp->outUsed++] = mccp->bits & 0xFF;
+		if (mccp->outUsed == sizeof(mccp->out))
+		{
+			client.write(mccp->out, mccp->outUsed);
+			mccp->outUsed = 0;
+		}
+		mccp->bits >>= 8;
+		mccp->bitCount -= 8;
+	}
+}
+
+// Huffman codes are stored starting with their most significant bit
+void TelnetSpy::deflateCode(uint16_t code, uint8_t count)
+{
+	uint16_t reversed = 0;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	deflateBits(reversed, count);
+}
+
+void TelnetSpy::deflateSymbol(uint16_t sym)
+{
+	if (sym < 144)
+	{
+		deflateCode(0x30 + sym, 8);
+	}
+	else if (sym < 256)
+	{
+		deflateCode(0x190 + sym - 144, 9);
+	}
+	else if (sym < 280)
+	{
+		deflateCode(sym - 256, 7);
+	}
+	else
+	{
+		deflateCode(0xC0 + sym - 280, 8);
+	}
+}
+
+void TelnetSpy::deflateMatch(uint16_t len, uint16_t dist)
+{
+	uint8_t i = 28;
+	while (deflateLenBase[i] > len)
+	{
+		i--;
+	}
+	deflateSymbol(257 + i);
+	deflateBits(len - deflateLenBase[i], deflateLenExtra[i]);
+	i = 29;
+	while (deflateDistBase[i] > dist)
+	{
+		i--;
+	}
+	deflateCode(i, 5);
+	deflateBits(dist - deflateDistBase[i], deflateDistExtra[i]);
+}
+
+// Compresses one block of data as fixed Huffman block followed by a sync
+// flush, so the client can decompress everything sent so far
+void TelnetSpy::deflateData(const uint8_t *data, size_t len)
+{
+	TelnetSpyDeflate *z = mccp;
+	uint32_t a = z->adlerA;
+	uint32_t b = z->adlerB;
+	for (size_t i = 0; i < len; i++)
+	{
+		a += data[i];
+		b += a;
+		if ((i & 0xFFF) == 0xFFF)
+		{
+			a %= 65521;
+			b %= 65521;
+		}
+	}
+	z->adlerA = a % 65521;
+	z->adlerB = b % 65521;
+
+	deflateBits(2, 3); // not final, fixed Huffman codes
+	size_t i = 0;
+	while (i < len)
+	{
+		uint16_t matchLen = 0;
+		uint16_t dist = 0;
+		if ((i + 2) < len)
+		{
+			uint16_t h = ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & (TELNETSPY_MCCP_HASH - 1);
+			dist = (uint16_t)z->pos - z->head[h];
+			z->head[h] = (uint16_t)z->pos;
+			if ((dist > 0) && (dist <= TELNETSPY_MCCP_WINDOW) && (dist <= z->pos))
+			{
+				uint16_t maxLen = min(len - i, (size_t)258);
+				while (matchLen < maxLen)
+				{
+					// Overlapping matches take the bytes from the input itself
+					uint8_t c = (matchLen < dist) ? z->window[(z->pos - dist + matchLen) & (TELNETSPY_MCCP_WINDOW - 1)]
+												  : data[i + matchLen - dist];
+					if (c != data[i + matchLen])
+					{
+						break;
+					}
+					matchLen++;
+				}
+			}
+		}
+		if (matchLen >= 3)
+		{
+			deflateMatch(matchLen, dist);
+		}
+		else
+		{
+			deflateSymbol(data[i]);
+			matchLen = 1;
+		}
+		for (uint16_t k = 0; k < matchLen; k++, i++)
+		{
+			if ((k > 0) && ((i + 2) < len))
+			{
+				z->head[((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & (TELNETSPY_MCCP_HASH - 1)] = (uint16_t)z->pos;
+			}
+			z->window[z->pos & (TELNETSPY_MCCP_WINDOW - 1)] = data[i];
+			z->pos++;
+		}
+	}
+	deflateSymbol(256); // end of block
+	// Sync flush: empty stored block
+	deflateBits(0, 3);
+	if (z->bitCount)
+	{
+		deflateBits(0, 8 - z->bitCount);
+	}
+	deflateBits(0x0000, 16);
+	deflateBits(0xFFFF, 16);
+	client.write(z->out, z->outUsed);
+	z->outUsed = 0;
+}
+#endif
+
+#ifdef TELNETSPY_SYSLOG
+bool TelnetSpy::setSyslog(IPAddress collector, uint16_t port, const char *hostname, const char *appName)
+{
+	stopSyslog();
+	// RFC 5424: <PRI>VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG
+	// (PRI is set per line by sendSyslog)
+	char header[96];
+	snprintf(header, sizeof(header), "1 - %s %s - - - ",
+			 (hostname && *hostname) ? hostname : "-", (appName && *appName) ? appName : "-");
+	syslogHeader = strdup(header);
+	syslogUdp = new WiFiUDP();
+	if (!syslogHeader || !syslogUdp)
+	{
+		stopSyslog();
+		return false;
+	}
+	syslogIP = collector;
+	syslogPort = port;
+	syslogHoldoff = 0;
+	syslogLineWait = false;
+	// start with all we hold
+	CRITCAL_SECTION_START
+	sysRdIdx = bufRdIdxStart;
+	sysLeftToSend = bufUsed;
+	CRITCAL_SECTION_END
+	return true;
+}
+
+void TelnetSpy::stopSyslog()
+{
+	if (syslogUdp)
+	{
+		CRITCAL_SECTION_START
+		WiFiUDP *udp = syslogUdp;
+		syslogUdp = NULL;
+		sysLeftToSend = 0;
+		CRITCAL_SECTION_END
+		udp->stop();
+		delete udp;
+	}
+	if (syslogHeader)
+	{
+		free(syslogHeader);
+		syslogHeader = NULL;
+	}
+}
+
+bool TelnetSpy::isSyslogActive()
+{
+	return syslogUdp != NULL;
+}
+
+void TelnetSpy::setSyslogRate(uint16_t datagramsPerSecond)
+{
+	syslogInterval = (datagramsPerSecond > 0) ? (1000 / datagramsPerSecond) : 0;
+}
+
+// Sends one line per datagram (RFC 5426) as long as the rate allows it.
+// Returns the time until the next one is due.
+uint32_t TelnetSpy::sendSyslog()
+{
+	// syslog severity of the TELNETSPY_LEVEL_x of a line
+	static const uint8_t severity[] = {TELNETSPY_SYSLOG_PRI & 7, 3, 4, 6, 7, 7};
+	if (!syslogUdp)
+	{
+		return TELNETSPY_NO_DEADLINE;
+	}
+	uint16_t headerLen = strlen(syslogHeader);
+	while (sysLeftToSend > 0)
+	{
+		if (isHoldoff(syslogHoldoff))
+		{
+			return holdoffLeft(syslogHoldoff);
+		}
+		CRITCAL_SECTION_START
+		uint16_t idx = sysRdIdx;
+		uint16_t left = sysLeftToSend;
+		uint32_t linePos = bufWrCount - left;
+		CRITCAL_SECTION_END
+		uint16_t maxLen = min(left, (uint16_t)(TELNETSPY_SYSLOG_MTU - headerLen - 5)); // 5: "<PRI>"
+		uint16_t len = 0;
+		while ((len < maxLen) && (telnetBuf[(idx + len) % bufLen] != '\n'))
+		{
+			len++;
+		}
+		if (len < maxLen)
+		{
+			len++; // the line end is taken too
+			syslogLineWait = false;
+		}
+		else if (len == left)
+		{
+			// Incomplete line, wait for its end up to the collecting time
+			if (!syslogLineWait)
+			{
+				syslogLineWait = true;
+				setHoldoff(syslogLineHoldoff, collectingTime);
+			}
+			if (isHoldoff(syslogLineHoldoff))
+			{
+				return holdoffLeft(syslogLineHoldoff);
+			}
+			syslogLineWait = false;
+		}
+		// else a line longer than a datagram is split
+		// Line end is not part of the message
+		uint16_t msgLen = len;
+		while ((msgLen > 0) && ((telnetBuf[(idx + msgLen - 1) % bufLen] == '\n') || (telnetBuf[(idx + msgLen - 1) % bufLen] == '\r')))
+		{
+			msgLen--;
+		}
+		bool sent = true; // empty lines are skipped
+		if (msgLen > 0)
+		{
+			int level = lineLevel(linePos, true);
+			char pri[6];
+			snprintf(pri, sizeof(pri), "<%d>", (TELNETSPY_SYSLOG_PRI & ~7) | severity[(level > 0) ? level : 0]);
+			uint16_t run = min(msgLen, (uint16_t)(bufLen - idx));
+			sent = syslogUdp->beginPacket(syslogIP, syslogPort);
+			if (sent)
+			{
+				syslogUdp->write((const uint8_t *)pri, strlen(pri));
+				syslogUdp->write((const uint8_t *)syslogHeader, headerLen);
+				syslogUdp->write((const uint8_t *)&telnetBuf[idx], run);
+				if (run < msgLen)
+				{
+					syslogUdp->write((const uint8_t *)telnetBuf, msgLen - run);
+				}
+				sent = syslogUdp->endPacket();
+			}
+			if (syslogInterval)
+			{
+				setHoldoff(syslogHoldoff, syslogInterval);
+			}
+		}
+		if (!sent)
+		{
+			// Network down: the data stays in the buffer and is sent later
+			return syslogInterval ? holdoffLeft(syslogHoldoff) : 0;
+		}
+		CRITCAL_SECTION_START
+		if ((sysRdIdx == idx) && (sysLeftToSend >= len)) // else evicted in the meantime
+		{
+			sysRdIdx = (idx + len) % bufLen;
+			sysLeftToSend -= len;
+		}
+		CRITCAL_SECTION_END
+	}
+	return TELNETSPY_NO_DEADLINE;
+}
+#endif
+
+#ifdef TELNETSPY_WEBSOCKET
+void TelnetSpy::setWebSocket(bool enable)
+{
+	webSocket = enable; // used for the next connection
+}
+
+bool TelnetSpy::getWebSocket()
+{
+	return webSocket;
+}
+
+static uint32_t TelnetSpy_rol(uint32_t value, uint8_t bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+// SHA-1 (RFC 3174) of a short message (less than 120 bytes), only used for the handshake
+static void TelnetSpy_sha1(const uint8_t *data, uint8_t len, uint8_t *digest)
+{
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	uint8_t msg[128];
+	uint8_t blocks = (len + 8) / 64 + 1;
+	memset(msg, 0, sizeof(msg));
+	memcpy(msg, data, len);
+	msg[len] = 0x80;
+	msg[blocks * 64 - 2] = (uint8_t)((len * 8) >> 8);
+	msg[blocks * 64 - 1] = (uint8_t)(len * 8);
+	for (uint8_t b = 0; b < blocks; b++)
+	{
+		uint32_t w[16];
+		for (uint8_t i = 0; i < 16; i++)
+		{
+			const uint8_t *p = &msg[b * 64 + i * 4];
+			w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+		}
+		uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+		for (uint8_t i = 0; i < 80; i++)
+		{
+			if (i >= 16)
+			{
+				w[i & 15] = TelnetSpy_rol(w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^ w[i & 15], 1);
+			}
+			uint32_t f, k;
+			if (i < 20)
+			{
+				f = (bb & c) | (~bb & d);
+				k = 0x5A827999;
 			}
+			else if (i < 40)
+			{
+				f = bb ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60)
+			{
+				f = (bb & c) | (bb & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else
+			{
+				f = bb ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			uint32_t t = TelnetSpy_rol(a, 5) + f + e + k + w[i & 15];
+			e = d;
+			d = c;
+			c = TelnetSpy_rol(bb, 30);
+			bb = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += bb;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+	for (uint8_t i = 0; i < 20; i++)
+	{
+		digest[i] = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+	}
+}
+
+// Base64 of "len" bytes into "out" (4 * ((len + 2) / 3) characters and a terminating zero)
+static void TelnetSpy_base64(const uint8_t *data, uint8_t len, char *out)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	for (uint8_t i = 0; i < len; i += 3)
+	{
+		uint32_t v = (uint32_t)data[i] << 16;
+		if (i + 1 < len)
+		{
+			v |= (uint32_t)data[i + 1] << 8;
+		}
+		if (i + 2 < len)
+		{
+			v |= data[i + 2];
+		}
+		*out++ = chars[(v >> 18) & 63];
+		*out++ = chars[(v >> 12) & 63];
+		*out++ = (i + 1 < len) ? chars[(v >> 6) & 63] : '=';
+		*out++ = (i + 2 < len) ? chars[v & 63] : '=';
+	}
+	*out = 0;
+}
+
+// Sends data as frames of up to TELNETSPY_WS_FRAME bytes (header and payload in one write)
+void TelnetSpy::wsFrame(uint8_t opcode, const uint8_t *data, size_t len)
+{
+	uint8_t frame[4 + TELNETSPY_WS_FRAME];
+	do
+	{
+		size_t part = min(len, (size_t)TELNETSPY_WS_FRAME);
+		uint8_t headerLen = 2;
+		frame[0] = 0x80 | opcode; // FIN
+		if (part < 126)
+		{
+			frame[1] = part;
+		}
+		else
+		{
+			frame[1] = 126;
+			frame[2] = part >> 8;
+			frame[3] = part & 0xFF;
+			headerLen = 4;
+		}
+		if (part)
+		{
+			memcpy(&frame[headerLen], data, part);
+		}
+		client.write(frame, headerLen + part);
+		data += part;
+		len -= part;
+	} while (len > 0);
+}
+
+// true if the comma separated header value contains the token (case insensitive)
+static bool TelnetSpy_hasToken(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+	for (; *value; value++)
+	{
+		if (strncasecmp(value, token, len) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+enum
+{
+	WS_HDR_REQUEST = 1, // the request line was read
+	WS_HDR_GET = 2,
+	WS_HDR_UPGRADE = 4,
+	WS_HDR_CONNECTION = 8,
+	WS_HDR_VERSION = 16,
+	WS_HDR_VALID = WS_HDR_REQUEST | WS_HDR_GET | WS_HDR_UPGRADE | WS_HDR_CONNECTION | WS_HDR_VERSION
+};
+
+void TelnetSpy::wsHandshakeLine()
+{
+	static const char keyHeader[] = "Sec-WebSocket-Key:";
+	static const char upgradeHeader[] = "Upgrade:";
+	static const char connectionHeader[] = "Connection:";
+	static const char versionHeader[] = "Sec-WebSocket-Version:";
+	wsLine[wsLineLen] = 0;
+	if (!(wsHeaders & WS_HDR_REQUEST))
+	{
+		// RFC 6455: the opening handshake is a GET request
+		wsHeaders |= WS_HDR_REQUEST;
+		if (strncmp(wsLine, "GET ", 4) == 0)
+		{
+			wsHeaders |= WS_HDR_GET;
+		}
+		return;
+	}
+	if (wsLineLen == 0)
+	{
+		// End of the request
+		if ((strlen(wsKey) != 24) || (wsHeaders != WS_HDR_VALID))
+		{
+			static const char bad[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+			client.write((const uint8_t *)bad, sizeof(bad) - 1);
+			client.stop();
+			return;
+		}
+		static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		uint8_t keyGuid[24 + sizeof(guid) - 1];
+		uint8_t digest[20];
+		char accept[29];
+		memcpy(keyGuid, wsKey, 24);
+		memcpy(&keyGuid[24], guid, sizeof(guid) - 1);
+		TelnetSpy_sha1(keyGuid, sizeof(keyGuid), digest);
+		TelnetSpy_base64(digest, sizeof(digest), accept);
+		static const char response[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+		client.write((const uint8_t *)response, sizeof(response) - 1);
+		client.write((const uint8_t *)accept, strlen(accept));
+		client.write((const uint8_t *)"\r\n\r\n", 4);
+		wsState = WS_OPEN;
+		if (strlen(welcomeMsg) > 0)
+		{
+			transmit((const uint8_t *)welcomeMsg, strlen(welcomeMsg));
+		}
+		return;
+	}
+	if (strncasecmp(wsLine, upgradeHeader, sizeof(upgradeHeader) - 1) == 0)
+	{
+		if (TelnetSpy_hasToken(&wsLine[sizeof(upgradeHeader) - 1], "websocket"))
+		{
+			wsHeaders |= WS_HDR_UPGRADE;
+		}
+	}
+	else if (strncasecmp(wsLine, connectionHeader, sizeof(connectionHeader) - 1) == 0)
+	{
+		if (TelnetSpy_hasToken(&wsLine[sizeof(connectionHeader) - 1], "upgrade"))
+		{
+			wsHeaders |= WS_HDR_CONNECTION;
+		}
+	}
+	else if (strncasecmp(wsLine, versionHeader, sizeof(versionHeader) - 1) == 0)
+	{
+		if (TelnetSpy_hasToken(&wsLine[sizeof(versionHeader) - 1], "13"))
+		{
+			wsHeaders |= WS_HDR_VERSION;
+		}
+	}
+	else if (strncasecmp(wsLine, keyHeader, sizeof(keyHeader) - 1) == 0)
+	{
+		const char *key = &wsLine[sizeof(keyHeader) - 1];
+		while (*key == ' ')
+		{
+			key++;
+		}
+		strncpy(wsKey, key, sizeof(wsKey) - 1);
+		wsKey[sizeof(wsKey) - 1] = 0;
+		char *end = strchr(wsKey, ' ');
+		if (end)
+		{
+			*end = 0;
 		}
 	}
+}
 
-	if (client.connected() && (bufUsed > 0))
+// Receive state machine: handshake lines, then frame header and (masked) payload
+void TelnetSpy::wsReceive(uint8_t c)
+{
+	if (wsState == WS_HANDSHAKE)
 	{
-		if (bufUsed >= minBlockSize)
+		if (c == '\n')
 		{
-			sendBlock();
+			wsHandshakeLine();
+			wsLineLen = 0;
 		}
-		else
+		else if ((c != '\r') && (wsLineLen < (TELNETSPY_WS_LINE - 1)))
 		{
-			unsigned long m = millis() & 0x7FFFFFF;
-			if (waitRef == 0xFFFFFFFF)
-			{
-				waitRef = m + collectingTime;
-				if (waitRef > 0x7FFFFFFF)
-				{
-					waitRef -= 0x80000000;
-				}
-			}
-			else
-			{
-				if (!((waitRef < 0x20000000) && (m > 0x60000000)) && (m >= waitRef))
-				{
-					sendBlock();
-				}
-			}
+			wsLine[wsLineLen++] = c;
 		}
+		return;
 	}
-	if (client.connected() && (pingRef != 0xFFFFFFFF))
+	if (wsRxLeft == 0)
 	{
-		unsigned long m = millis() & 0x7FFFFFF;
-		if (!((pingRef < 0x20000000) && (m > 0x60000000)) && (m >= pingRef))
+		wsRxHeader[wsRxHeaderLen++] = c;
+		if (wsRxHeaderLen < 2)
 		{
-			if (nvtDetected)
-			{
-				// Send a NOP via telnet NVT protocol
-				addTelnetBuf(255);
-				addTelnetBuf(241);
-			}
-			else
-			{
-				// Send a NULL
-				addTelnetBuf(0);
-			}
-			sendBlock();
+			return;
+		}
+		uint8_t len7 = wsRxHeader[1] & 0x7F;
+		uint8_t need = 2 + ((len7 == 126) ? 2 : ((len7 == 127) ? 8 : 0)) + ((wsRxHeader[1] & 0x80) ? 4 : 0);
+		if (wsRxHeaderLen < need)
+		{
+			return;
+		}
+		wsRxLeft = len7;
+		if (len7 == 126)
+		{
+			wsRxLeft = ((uint32_t)wsRxHeader[2] << 8) | wsRxHeader[3];
+		}
+		else if (len7 == 127)
+		{
+			wsRxLeft = ((uint32_t)wsRxHeader[6] << 24) | ((uint32_t)wsRxHeader[7] << 16) | ((uint32_t)wsRxHeader[8] << 8) | wsRxHeader[9];
 		}
+		wsRxMaskIdx = 0;
+		wsCtrlLen = 0;
+		if (wsRxLeft == 0)
+		{
+			wsFrameDone();
+		}
+		return;
 	}
-#endif
-	if (client.connected())
+	if (wsRxHeader[1] & 0x80)
 	{
-		checkReceive();
+		c ^= wsRxHeader[wsRxHeaderLen - 4 + (wsRxMaskIdx++ & 3)];
+	}
+	wsRxLeft--;
+	if (wsRxHeader[0] & 0x08)
+	{
+		// Control frame
+		if (wsCtrlLen < TELNETSPY_WS_CTRL)
+		{
+			wsCtrl[wsCtrlLen++] = c;
+		}
+	}
+	else
+	{
+		parseReceived(c);
+	}
+	if (wsRxLeft == 0)
+	{
+		wsFrameDone();
 	}
 }
 
-void TelnetSpy::writeRecBuf(char c)
+void TelnetSpy::wsFrameDone()
 {
-	if (recLen == recUsed)
+	wsRxHeaderLen = 0;
+	switch (wsRxHeader[0] & 0x0F)
 	{
-		return;
+	case 8: // close: answer with the status code and disconnect
+		wsFrame(8, wsCtrl, min(wsCtrlLen, (uint8_t)2));
+		client.stop();
+		break;
+	case 9: // ping
+		wsFrame(10, wsCtrl, wsCtrlLen);
+		break;
+	default:
+		break;
 	}
-	CRITCAL_SECTION_START
-	recBuf[recWrIdx++] = c;
-	if (recWrIdx >= recLen)
+}
+#endif
+
+// Aho-Corasick automaton of the grep patterns. The trie is stored as first
+// child / next sibling lists (0: none, the root is node 0), so the memory is
+// bounded by TELNETSPY_GREP_NODES.
+struct TelnetSpyGrep
+{
+	uint8_t used;
+	char ch[TELNETSPY_GREP_NODES];
+	uint8_t child[TELNETSPY_GREP_NODES];
+	uint8_t sibling[TELNETSPY_GREP_NODES];
+	uint8_t fail[TELNETSPY_GREP_NODES];
+	bool match[TELNETSPY_GREP_NODES]; // a pattern ends here (or at a suffix)
+};
+
+static uint8_t TelnetSpy_grepChild(TelnetSpyGrep *g, uint8_t node, char c)
+{
+	for (uint8_t n = g->child[node]; n; n = g->sibling[n])
 	{
-		recWrIdx = 0;
+		if (g->ch[n] == c)
+		{
+			return n;
+		}
 	}
-	recUsed++;
-	CRITCAL_SECTION_END
+	return 0;
 }
 
-void TelnetSpy::checkReceive()
+bool TelnetSpy::setGrep(const char *patterns, uint8_t after)
 {
-	int n = client.available();
-	while (n > 0)
+	if (grep)
+	{
+		free(grep);
+		grep = NULL;
+	}
+	grepAfter = after;
+	grepContextLeft = 0;
+	if (!patterns || !*patterns)
+	{
+		return true;
+	}
+	TelnetSpyGrep *g = (TelnetSpyGrep *)calloc(1, sizeof(TelnetSpyGrep));
+	if (!g)
 	{
-		char c, c2;
-		c = client.peek();
-		if (filterChar && (filterChar == c))
+		return false;
+	}
+	g->used = 1;
+	// Trie of the patterns, separated by "|"
+	uint8_t node = 0;
+	for (const char *p = patterns;; p++)
+	{
+		if ((*p == '|') || (*p == 0))
 		{
-			// Filter character detected
-			if (strlen(filterMsg) > 0)
+			if (node)
 			{
-				client.write((const uint8_t *)filterMsg, strlen(filterMsg));
+				g->match[node] = true;
 			}
-			client.read(); // Remove filter character
-			n--;
-			if (filterCallback != NULL)
+			node = 0;
+			if (*p == 0)
 			{
-				filterCallback();
+				break;
 			}
 			continue;
 		}
-		if (255 == c)
-		{ // If IAC (start of telnet NVT protocol telegram):
-			if (n == 1)
+		uint8_t next = TelnetSpy_grepChild(g, node, *p);
+		if (!next)
+		{
+			if (g->used >= TELNETSPY_GREP_NODES)
 			{
-				// Telegram incomplete
-				return;
+				free(g);
+				return false;
 			}
-			client.read(); // Remove IAC
-			n--;
-			c = client.read(); // Gett command byte
-			n--;
-			switch (c)
+			next = g->used++;
+			g->ch[next] = *p;
+			g->sibling[next] = g->child[node];
+			g->child[node] = next;
+		}
+		node = next;
+	}
+	// Failure links, breadth first
+	uint8_t queue[TELNETSPY_GREP_NODES];
+	uint8_t head = 0;
+	uint8_t tail = 0;
+	for (uint8_t n = g->child[0]; n; n = g->sibling[n])
+	{
+		queue[tail++] = n;
+	}
+	while (head < tail)
+	{
+		uint8_t u = queue[head++];
+		for (uint8_t v = g->child[u]; v; v = g->sibling[v])
+		{
+			uint8_t f = g->fail[u];
+			while (f && !TelnetSpy_grepChild(g, f, g->ch[v]))
 			{
-			case 241: // Telnet command "NOP" (no operation)
-				if (pingTime != 0)
-				{
-#ifdef RLJ_SPY_MODS
-					setHoldoff(pingHoldoff, pingTime);
-#else
-					pingRef = (millis() & 0x7FFFFFF) + pingTime;
-#endif
-				}
-				break;
-			case 242: // Telnet command "Data Mark" (not yet implemented)
-				break;
-			case 243: // Telnet command "Break";
-				if (callbackNvtBRK != NULL)
-				{
-					callbackNvtBRK();
-				}
-				break;
-			case 244: // Telnet command "Interrupt process"
-				if (callbackNvtIP != NULL)
-				{
-					if ((void (*)())1 == callbackNvtIP)
-					{
-						ESP.restart();
-					}
-					else
-					{
-						callbackNvtIP();
-					}
-				}
-				break;
-			case 245: // Telnet command "Abort output"
-				if (callbackNvtAO != NULL)
-				{
-					if ((void (*)())1 == callbackNvtAO)
-					{
-						disconnectClient();
-					}
-					else
-					{
-						callbackNvtAO();
-					}
-				}
-				break;
-			case 246: // Telnet command "Are you there"
-				if (callbackNvtAYT != NULL)
-				{
-					callbackNvtAYT();
-				}
-				break;
-			case 247: // Telnet command "Erase character"
-				if (callbackNvtEC != NULL)
-				{
-					callbackNvtEC();
-				}
-				break;
-			case 248: // Telnet command "Erase line"
-				if (callbackNvtEL != NULL)
-				{
-					callbackNvtEL();
-				}
-				break;
-			case 249: // Telnet command "Go ahead"
-				if (callbackNvtGA != NULL)
-				{
-					callbackNvtGA();
-				}
-				break;
-			case 250: // Telnet command "SB" (additional data follows)
-				while (n > 0)
-				{
-					c = client.read();
-					n--;
-					if (255 != c)
-					{
-						// If not IAC, ignore it
-						continue;
-					}
-					c = client.read();
-					n--;
-					if (240 != c)
-					{
-						// If not SE (end of additional data), ignore it
-						continue;
-					}
-				}
-				break;
-			case 251: // Telnet command "WILL"
-			case 252: // Telnet command "WON'T"
-			case 253: // Telnet command "DO"
-			case 254: // Telnet command "DON'T"
-				nvtDetected = true;
-				c2 = client.read(); // Get option byte
-				n--;
-				if (callbackNvtWWDD != NULL)
-				{
-					callbackNvtWWDD(c, c2);
-				}
-				break;
-			case 255: // Escaped data byte 0xff
-				if (recBuf)
-				{
-					writeRecBuf(c);
-				}
-				else
-				{
-					// If no receive buffer is used, the data byte 0xff will be lost.
-					// May be in the future there is a solution for this problem.
-				}
-				break;
+				f = g->fail[f];
 			}
-			continue;
+			g->fail[v] = TelnetSpy_grepChild(g, f, g->ch[v]);
+			g->match[v] |= g->match[g->fail[v]];
+			queue[tail++] = v;
 		}
-		// Next character in the client buffer is a normal character
-		if (recBuf)
+	}
+	grep = g;
+	return true;
+}
+
+// 1 if the line at "linePos" contains a pattern, 0 if not, -1 if the line is incomplete
+int TelnetSpy::grepLine(uint32_t linePos, bool force)
+{
+	CRITCAL_SECTION_START
+	uint32_t oldest = bufWrCount - bufUsed;
+	uint32_t left = bufWrCount - linePos;
+	CRITCAL_SECTION_END
+	if (left > bufUsed)
+	{
+		return 0; // not in the buffer anymore
+	}
+	uint16_t idx = (bufRdIdxStart + (linePos - oldest)) % bufLen;
+	uint8_t state = 0;
+	bool found = false;
+	while (left > 0)
+	{
+		uint16_t run = min(left, (uint32_t)(bufLen - idx));
+		const char *data = &telnetBuf[idx];
+		for (uint16_t i = 0; i < run; i++)
 		{
-			client.read();
-			writeRecBuf(c);
-			n--;
-			continue;
+			char c = data[i];
+			if (c == '\n')
+			{
+				return found;
+			}
+			if (found)
+			{
+				continue; // just looking for the line end
+			}
+			uint8_t next;
+			while (!(next = TelnetSpy_grepChild(grep, state, c)) && state)
+			{
+				state = grep->fail[state];
+			}
+			state = next;
+			found = grep->match[state];
 		}
-		// Leave the character in the client buffer
-		return;
+		left -= run;
+		idx = 0;
 	}
+	return force ? found : -1;
 }
 
-#ifdef RLJ_SPY_MODS
-void TelnetSpy::setHoldoff(unsigned long &holdoff, unsigned long period)
+// Token buckets of the ingress governor, one per source. The tokens are
+// counted in 1/1000 bytes (lines), so the refill per ms is the rate per s.
+struct TelnetSpyGovernor
 {
-	holdoff = millis() + period;
-	if (holdoff == 0)
-		holdoff++; // a valid delay must avoid zero!
+	uint32_t byteRate; // bytes per second, 0: no limit
+	uint16_t lineRate; // lines per second, 0: no limit
+	uint16_t sampling; // over budget every n-th line passes, 0: none
+	uint16_t sampleCount;
+	int32_t byteTokens;
+	int32_t lineTokens;
+	unsigned long lastRefill;
+	uint32_t suppressed; // all suppressed lines
+	uint32_t unreported; // suppressed lines since the last summary
+	bool lineStart;
+	bool pass;	  // the current line passes
+	bool sampled; // the current line passes as sample (no tokens taken)
+};
+
+static const char *const governorNames[] = {"write", "os_print", "esp_log"};
+
+bool TelnetSpy::setGovernor(governorSource source, uint32_t bytesPerSecond, uint16_t linesPerSecond, uint16_t sampling)
+{
+	if (source >= TELNETSPY_GOVERNOR_SOURCES)
+	{
+		return false;
+	}
+	if (!governors)
+	{
+		if (!bytesPerSecond && !linesPerSecond)
+		{
+			return true;
+		}
+		TelnetSpyGovernor *g = (TelnetSpyGovernor *)calloc(TELNETSPY_GOVERNOR_SOURCES, sizeof(TelnetSpyGovernor));
+		if (!g)
+		{
+			return false;
+		}
+		for (uint8_t i = 0; i < TELNETSPY_GOVERNOR_SOURCES; i++)
+		{
+			g[i].lineStart = true;
+			g[i].pass = true;
+		}
+		governors = g;
+	}
+	TelnetSpyGovernor &gov = governors[source];
+	CRITCAL_SECTION_START
+	gov.byteRate = min(bytesPerSecond, (uint32_t)TELNETSPY_GOVERNOR_MAX_RATE);
+	gov.lineRate = linesPerSecond;
+	gov.sampling = sampling;
+	gov.sampleCount = 0;
+	gov.byteTokens = gov.byteRate * 1000; // start with the budget of one second
+	gov.lineTokens = (int32_t)gov.lineRate * 1000;
+	gov.lastRefill = millis();
+	CRITCAL_SECTION_END
+	return true;
 }
 
-bool TelnetSpy::isHoldoff(unsigned long &holdoff)
+uint32_t TelnetSpy::getSuppressed(governorSource source)
 {
-	if (holdoff)
+	if (!governors || (source >= TELNETSPY_GOVERNOR_SOURCES))
 	{
-		long tDelta = millis() - holdoff; // signed value performs as required for rollover in any situation
-		if (tDelta >= 0)
-			holdoff = 0;
+		return 0;
 	}
-	return holdoff != 0;
+	return governors[source].suppressed;
+}
+
+// Decides at each line start whether the line passes, returns false for the bytes of a suppressed line
+bool TelnetSpy::governByte(uint8_t source, char c)
+{
+	TelnetSpyGovernor &gov = governors[source];
+	if (!gov.byteRate && !gov.lineRate)
+	{
+		return true;
+	}
+	if (gov.lineStart)
+	{
+		unsigned long now = millis();
+		uint32_t elapsed = min((uint32_t)(now - gov.lastRefill), (uint32_t)1000); // the buckets hold one second
+		gov.lastRefill = now;
+		gov.byteTokens = min(gov.byteTokens + (int32_t)(elapsed * gov.byteRate), (int32_t)(gov.byteRate * 1000));
+		gov.lineTokens = min(gov.lineTokens + (int32_t)(elapsed * gov.lineRate), (int32_t)gov.lineRate * 1000);
+		gov.sampled = false;
+		if ((!gov.byteRate || (gov.byteTokens > 0)) && (!gov.lineRate || (gov.lineTokens >= 1000)))
+		{
+			gov.lineTokens -= 1000;
+			gov.sampleCount = 0;
+			gov.pass = true;
+		}
+		else if (gov.sampling && (++gov.sampleCount >= gov.sampling))
+		{
+			gov.sampleCount = 0;
+			gov.sampled = true;
+			gov.pass = true;
+		}
+		else
+		{
+			gov.suppressed++;
+			gov.unreported++;
+			gov.pass = false;
+		}
+		if (gov.pass && gov.unreported)
+		{
+			governorDue = true; // stored by write() or handle(), this may run within a lock
+		}
+	}
+	gov.lineStart = (c == '\n');
+	if (gov.pass && !gov.sampled)
+	{
+		gov.byteTokens -= 1000;
+	}
+	return gov.pass;
+}
+
+// Stores the summaries of suppressed lines, returns the time until the next one is due
+uint32_t TelnetSpy::governorReport()
+{
+	governorDue = false;
+	bool pending = false;
+	for (uint8_t source = 0; source < TELNETSPY_GOVERNOR_SOURCES; source++)
+	{
+		pending |= (governors[source].unreported > 0);
+	}
+	if (!pending)
+	{
+		return TELNETSPY_NO_DEADLINE;
+	}
+	if (isHoldoff(governorHoldoff))
+	{
+		return holdoffLeft(governorHoldoff);
+	}
+	if (bufReserved)
+	{
+		return collectingTime;
+	}
+	if (telnetBuf && bufUsed && (telnetBuf[(bufWrIdx ? bufWrIdx : bufLen) - 1] != '\n'))
+	{
+		return collectingTime; // not in the middle of a line
+	}
+	for (uint8_t source = 0; source < TELNETSPY_GOVERNOR_SOURCES; source++)
+	{
+		TelnetSpyGovernor &gov = governors[source];
+		if (!gov.unreported)
+		{
+			continue;
+		}
+		char msg[64];
+		int len = snprintf(msg, sizeof(msg), "TelnetSpy: %lu lines of %s suppressed\r\n", (unsigned long)gov.unreported, governorNames[source]);
+		gov.unreported = 0;
+		if (telnetBuf || bufSize)
+		{
+			if ((storeOffline || isOnline()) && needBuffer())
+			{
+				for (int i = 0; i < len; i++)
+				{
+					storeByte(msg[i]); // the overflow policy applies to summaries too
+				}
+			}
+		}
+		else if (!taskOwnsClient() && client.connected())
+		{
+			writeClient((const uint8_t *)msg, len);
+		}
+		if ((source == GOVERN_WRITE) && (NULL != usedSer) && *usedSer)
+		{
+			usedSer->write((const uint8_t *)msg, len);
+		}
+	}
+	setHoldoff(governorHoldoff, TELNETSPY_GOVERNOR_REPORT);
+	return TELNETSPY_NO_DEADLINE;
 }
-#endif
@@ -54,6 +54,14 @@
  * Add the following line at the beginning of your main loop ( void loop() ):
  *		SERIAL.handle();
  *
+ * handle() returns the time (in ms) until it has to be called again at the
+ * latest (0 => as soon as possible, TELNETSPY_NO_DEADLINE => nothing is
+ * scheduled). A battery powered app may sleep this long, but received data
+ * and new connections are not foreseeable, and data written in between may
+ * shorten the time. While not connected to WiFi, the WiFi state is checked
+ * every TELNETSPY_WIFI_CHECK ms only.
+ *		uint32_t handle();
+ *
  * Use the following functions of the TelnetSpy object to modify behavior
  *
  * Change the port number of this telnet server. If a client is already
@@ -90,8 +98,10 @@
  * If buffering is disabled, the system's debug output (see setDebugOutput)
  * cannot be send via telnet, it will be send to serial output only.
  * Changing size tries to preserve the already collected data. If the new
- * buffer size is too small the youngest data will be preserved only. Returns
- * false if the requested buffer size cannot be set.
+ * buffer size is too small the youngest lines will be preserved only. Returns
+ * false if the requested buffer size cannot be set. The buffer is allocated
+ * with the first data stored or when a client connects, until then the size
+ * is noted only.
  * Default: 3000
  *		bool setBufferSize(uint16_t newSize);
  *
@@ -125,6 +135,7 @@
  * by your app, the handling of the NVT protocol and the "filter character"
  * will not work. If no receive buffer is used, you cannot receive the code
  * 0xff (it will be lost because of a limitation of the WiFiAPI).
+ * The receive buffer is allocated when a client connects.
  * Default: 64
  *		bool setRecBufferSize(uint16_t newSize);
  *
@@ -221,6 +232,102 @@
  * Default: NULL
  *		void setCallbackOnNvtWWDD(void (*callback)(char command, char option));
  *
+ * Only ESP32: start a FreeRTOS task which handles the telnet connection
+ * (accepting, sending and receiving) in the background, optionally pinned to
+ * the given core. So a delay() or a long computation in loop() does not stop
+ * sending the log anymore. The task runs every TELNETSPY_TASK_PERIOD ms and
+ * is woken up by write() as soon as a block of <minSize> bytes (defined by
+ * setMinBlockSize) is ready. While the task is running, calling handle() is
+ * not needed (it does nothing). disconnectClient(), setPort() and
+ * toggle(false) are then done by the task shortly after the call. Without a
+ * buffer (size 0) the data goes to the serial port only, as only the task may
+ * use the client. stopTask is called by end(). Returns false if the task
+ * cannot be created.
+ *		bool startTask(BaseType_t core = tskNO_AFFINITY);
+ *		void stopTask();
+ *		bool isTaskRunning();
+ *
+ * This function sets a character which starts an in-band command when it is
+ * the first character of a line received from the telnet client. The rest of
+ * the line is taken as command and is not passed to the receive buffer. The
+ * answer is sent to the telnet client only (it is not stored in the transmit
+ * buffer). Send "<ch>help" to get a list of the available commands. Commands
+ * are only handled if the receive buffer is used. Use 0 to disable commands.
+ * Default: 0
+ *		void setCommandPrefix(char ch);
+ *
+ * This function returns the actual command prefix (0 => not set).
+ *		char getCommandPrefix();
+ *
+ * Enable / disable the binary safe mode. The telnet protocol uses the code
+ * 0xff (IAC) as start of a command, so a data byte 0xff must be sent twice.
+ * If the binary safe mode is enabled, this is done while sending the data, so
+ * binary data and UTF-8 text can be sent without corrupting the stream.
+ * Default: false
+ *		void setBinarySafe(bool enable);
+ *
+ * Get actual state of the binary safe mode.
+ *		bool getBinarySafe();
+ *
+ * Enable / disable the negotiation of telnet options. If it is enabled,
+ * TelnetSpy asks the client on connect to edit lines locally and to send them
+ * complete (LINEMODE) and to report its window size (NAWS). In binary safe
+ * mode it offers the BINARY option too. SUPPRESS GO AHEAD is accepted, ECHO
+ * and all other options are refused. The callback set by setCallbackOnNvtWWDD
+ * is still called for all received options.
+ * Default: false
+ *		void setNegotiation(bool enable);
+ *
+ * Get actual state of the negotiation of telnet options.
+ *		bool getNegotiation();
+ *
+ * These functions return the window size of the telnet client if it was
+ * reported by the NAWS option (0 => unknown).
+ *		uint16_t getWindowWidth();
+ *		uint16_t getWindowHeight();
+ *
+ * If TELNETSPY_MCCP is defined, TelnetSpy can compress the data sent to the
+ * telnet client (MCCP2, telnet option 86), which is useful on weak WiFi
+ * links. setCompression allocates the memory of the compressor (about 4 kB,
+ * see TELNETSPY_MCCP_WINDOW) and offers the option if the negotiation of
+ * telnet options is enabled (see setNegotiation). Returns false if the memory
+ * cannot be allocated. If the client does not accept the option, the data is
+ * sent uncompressed. isCompressing returns true while data is compressed.
+ * Default: false
+ *		bool setCompression(bool enable);
+ *		bool getCompression();
+ *		bool isCompressing();
+ *
+ * If TELNETSPY_LATENCY_STATS is defined, TelnetSpy measures the time (in us)
+ * the data of a connected client waits in the transmit buffer until it is
+ * handed over to the telnet connection. The values are collected in a
+ * histogram with logarithmic buckets, so percentiles are returned as the upper
+ * bound of the matching bucket. The in-band command "latency" shows the same
+ * values to the telnet client.
+ *		uint32_t getLatencyPercentile(uint8_t percent);
+ *		uint32_t getLatencyMax();
+ *		uint32_t getLatencyCount();
+ *		void resetLatencyStats();
+ *
+ * If TELNETSPY_TRACE is defined, TelnetSpy records the begin and the end (in
+ * us) of its internal phases (handle, sendBlock, checkReceive, connect /
+ * disconnect handling and removing of old lines) in a ring of
+ * TELNETSPY_TRACE_EVENTS entries. exportTrace writes the recorded events in
+ * the Chrome trace event format (JSON) to the given output, so it can be
+ * loaded by chrome://tracing or Perfetto. The in-band command "trace" sends
+ * the same data to the telnet client.
+ *		void exportTrace(Print &out);
+ *		void clearTrace();
+ *
+ * Besides reading single characters by read(), data can be read in blocks.
+ * These functions copy all data which is already available (first from the
+ * serial port, then from the telnet connection) at once. readBytes and
+ * readBytesUntil wait for more data up to the timeout of setTimeout, like the
+ * functions of Stream.
+ *		int read(uint8_t *buffer, size_t size);
+ *		size_t readBytes(char *buffer, size_t length);
+ *		size_t readBytesUntil(char terminator, char *buffer, size_t length);
+ *
  * HINT
  *
  * Add the following lines to your sketch:
@@ -243,9 +350,73 @@
  * Transfering data also via telnet will need more performance than the serial
  * port only. So time critical things may be influenced.
  *
+ * The telnet client may reduce the data sent to it with the in-band commands
+ * (see setCommandPrefix) "level e|w|i|d|v" (lines up to this level only) and
+ * "tags a,b,c" (tagged lines with these tags only, the tag is the file name
+ * of "[E][file.cpp:12] ..." or the tag of "E (123) tag: ...", a leading
+ * "[  1234]" time stamp is skipped). Lines without level or tag are always
+ * sent. Filtered lines are skipped when sending, the
+ * buffer still holds them. The filter starts anew with each connection, the
+ * app may set it too (e.g. in the connect callback).
+ *		void setClientLevel(uint8_t level);
+ *		uint8_t getClientLevel();
+ *		void setClientTags(const char *tags);
+ *		const char *getClientTags();
+ *
+ * The in-band command "grep [-A n] a|b|c" (or setGrep) lets only lines
+ * containing one of the patterns (and n lines after each of them) through.
+ * The patterns are matched in one pass (Aho-Corasick), all patterns together
+ * may have up to TELNETSPY_GREP_NODES characters. "grep" alone sends all.
+ *		bool setGrep(const char *patterns, uint8_t after = 0);
+ *
+ * More destinations (a file, another port, ...) can be added as sinks. A sink
+ * is derived from TelnetSpySink and implements consume(). All sinks share the
+ * buffer, each one reads it at its own pace, with its own block size,
+ * collecting time and level filter (lines starting like "[E]" or "E (" of
+ * the ESP log macros are filtered by their level). If a sink takes less data
+ * than offered, the rest is offered later again, as long as it is still in
+ * the buffer.
+ *		bool addSink(TelnetSpySink &sink, bool history = true);
+ *		void removeSink(TelnetSpySink &sink);
+ *
+ * Uncomment "#define TELNETSPY_SYSLOG" to be able to send the buffer to a
+ * syslog collector as UDP datagrams (RFC 5424 / 5426), too. Each line is sent
+ * as a datagram of its own (split at TELNETSPY_SYSLOG_MTU bytes), with the
+ * severity of its level ("[E]", "W (123)", ...). An incomplete line is sent
+ * after the collecting time (see setCollectingTime). While the network is
+ * down, the data stays in the buffer (as long as it fits).
+ *		bool setSyslog(IPAddress collector, uint16_t port = TELNETSPY_SYSLOG_PORT,
+ *					   const char *hostname = NULL, const char *appName = "TelnetSpy");
+ *		void stopSyslog();
+ *		bool isSyslogActive();
+ *		void setSyslogRate(uint16_t datagramsPerSecond);
+ *
+ * Uncomment "#define TELNETSPY_WEBSOCKET" to be able to use a WebSocket
+ * (RFC 6455) instead of telnet, so the log can be watched in a browser. The
+ * data is sent as binary frames (use a TextDecoder on the browser side), the
+ * text typed in the browser goes into the receive buffer. The port is set by
+ * setPort as usual.
+ *		void setWebSocket(bool enable);
+ *		bool getWebSocket();
+ *
  * It is not possible to establish more than one telnet connection at the same
  * time. But its possible to use more than one instance of TelnetSpy.
  *
+ * Instead of listening on its own port, an instance can be a channel of
+ * another (host) instance. It keeps its own buffer and settings, but its
+ * data is sent by the host's handle() via the host's connection, so no
+ * additional socket is needed. Before data of another channel is sent, the
+ * host sends "IAC SB TELNETSPY_CHANNEL_OPTION <id> IAC SE" (the data of the
+ * host itself has the id 0). A telnet client ignores this, a tool can use it
+ * to split the channels. Received data always goes to the host. A channel
+ * needs a buffer (see setBufferSize), calling its handle() is not needed,
+ * the host's handle() does its work too (repeat counts, sinks, ...) and
+ * includes its deadlines (call setSerial(NULL) if it should not write to the
+ * serial port too).
+ *		bool addChannel(TelnetSpy &channel, uint8_t id);
+ *		void removeChannel(TelnetSpy &channel);
+ *		uint8_t getChannel();
+ *
  * If you have problems with low memory you may reduce the value of the define
  * TELNETSPY_BUFFER_LEN for a smaller ring buffer on initialisation.
  *
@@ -255,6 +426,106 @@
  * setDebugOutput at last. On default TelnetSpy has the capturing of OS_print
  * calls enabled. So if you have more instances the last created instance will
  * handle the capturing.
+ *
+ * The captured system output may come from interrupts or exception handlers,
+ * so it is collected in a lock free staging ring (TELNETSPY_CAPTURE_LEN
+ * bytes per source) first and moved to the buffer by handle(). If the ring is
+ * full, the chars are lost and the number is noted in the buffer. The target
+ * instance can be selected per source (on ESP32 the output of ESP_LOGx can be
+ * captured too). setDebugOutput(x) is the same as
+ * setCapture(TelnetSpy::CAPTURE_OS_PRINT, x).
+ *		void setCapture(captureSource source, bool enable);
+ *		bool getCapture(captureSource source);
+ *		void drainCapture(void);
+ *
+ * A runaway log loop would evict the whole history from the buffer within
+ * milliseconds. The governor limits the bytes and lines per second of each
+ * source (the sketch's writes, os_print, ESP_LOGx) by token buckets, which
+ * hold the budget of one second. Over budget, only every n-th line passes
+ * (0: none). The number of suppressed lines is stored as a line
+ * "TelnetSpy: n lines of <source> suppressed" at most every
+ * TELNETSPY_GOVERNOR_REPORT ms. Suppressed lines of the sketch are not
+ * written to the serial port either. A rate of 0 means no limit.
+ *		bool setGovernor(governorSource source, uint32_t bytesPerSecond, uint16_t linesPerSecond,
+ *						 uint16_t sampling = TELNETSPY_GOVERNOR_SAMPLING);
+ *		uint32_t getSuppressed(governorSource source);
+ *
+ * To throttle the logging before data is lost, the app can watch the data
+ * not yet taken by the slowest reader (telnet client, syslog, sinks). If it
+ * reaches the high watermark (0: off), isBackpressure() is true until it
+ * drops to the low watermark, the callback is called on both changes (by
+ * write() at a line end or handle()). While no client is connected (see setStoreOffline),
+ * all stored data is pending. availableForWrite() returns the free space of
+ * the buffer (and the serial port), writing more evicts the oldest lines.
+ *		void setWatermarks(uint16_t high, uint16_t low);
+ *		bool isBackpressure();
+ *		void setCallbackOnWatermark(void (*callback)(bool high));
+ *		uint16_t getBufferUsed();
+ *		uint16_t getBufferPending();
+ *
+ * Producers of larger blocks (formatters, binary data) can write into the
+ * buffer directly instead of into a scratch buffer first: reserve() makes
+ * room for up to "len" bytes (evicting the oldest lines) and returns the
+ * reserved length as one or two spans (the second one if the ring wraps
+ * around). commit() stores the first "len" bytes of them at once and writes
+ * them to the serial port. Nothing else must be written to the instance in
+ * between. reserve() returns 0 if nothing would be stored (no buffer, not
+ * enabled, no client while setStoreOffline(false)), use write() then. The
+ * data does not pass the governor.
+ *		uint16_t reserve(uint16_t len, char *&data1, uint16_t &len1, char *&data2, uint16_t &len2);
+ *		void commit(uint16_t len);
+ *
+ * The buffer can be exported (e.g. to a file or a HTTP client) without
+ * disturbing the telnet session. The export covers the data stored when it
+ * starts, it is copied in blocks of TELNETSPY_EXPORT_CHUNK bytes (on the
+ * stack), the writers are locked out only while a block is copied. Lines
+ * evicted before they could be exported are skipped, noted by the line
+ * "TelnetSpy: n bytes lost". Returns the number of exported bytes.
+ *		size_t exportBuffer(Print &out);
+ *
+ * If the buffer is full, the oldest line is removed by default
+ * (OVERFLOW_DROP_OLDEST). With OVERFLOW_DROP_NEWEST only lines already sent
+ * to the client are removed, otherwise new lines are dropped (e.g. to keep
+ * the boot log until a client gets it). OVERFLOW_BLOCK lets write() send
+ * data to the client until the oldest line is sent, at most "timeout" ms,
+ * then (or without client) the oldest line is removed. Captured system
+ * output never blocks. The policy can be given for a single write too.
+ *		void setOverflowPolicy(overflowPolicy policy, uint16_t timeout = TELNETSPY_OVERFLOW_TIMEOUT);
+ *		overflowPolicy getOverflowPolicy();
+ *		size_t write(const uint8_t *buffer, size_t size, overflowPolicy policy);
+ *
+ * With setCollapse(true), a line written by the sketch which is the same as
+ * the line before is not stored again, it is counted only. When a different
+ * line follows (or nothing follows within the collecting time), the line
+ * "TelnetSpy: last line repeated n times" is stored, during a longer run
+ * every TELNETSPY_COLLAPSE_REPORT ms. The serial port gets
+ * all lines. Lines longer than a quarter of the buffer are not collapsed.
+ *		void setCollapse(bool enable);
+ *		bool getCollapse();
+ *
+ * A new client gets the whole buffer first. To see the live output sooner,
+ * the replay can be limited to the last "lines" lines and / or the lines of
+ * the last "seconds" seconds (0: no limit). For the time limit the start of
+ * a line is noted every "seconds" / 16 s (TELNETSPY_REPLAY_MARKS entries),
+ * so a few older lines may be sent too. The client can get the history on
+ * demand by the in-band command "history [all|<lines>|<seconds>s]" (with
+ * seconds only if a time limit is set).
+ *		void setReplay(uint16_t lines, uint16_t seconds = 0);
+ *
+ * In the adaptive mode the buffer size follows the memory of the sketch. Every
+ * TELNETSPY_HEAP_CHECK ms (in handle) the buffer is halved down to "minSize" if
+ * the free heap drops below "heapReserve" or the largest free block below a
+ * quarter of it. If memory recovers, the buffer is doubled up to "targetSize",
+ * or up to "maxSize" while a reader lags behind by more than half the buffer.
+ * Shrinking keeps the youngest lines. minSize 0 disables the adaptive mode.
+ *		bool setAdaptiveBuffer(uint16_t minSize, uint16_t targetSize, uint16_t maxSize, uint32_t heapReserve = TELNETSPY_HEAP_RESERVE);
+ *
+ * Release the buffers after "time" ms without client and without data not sent
+ * yet (to the client, syslog or sinks). The receive buffer is freed, the
+ * transmit buffer is freed or shrunk to "floorSize" (keeping the youngest
+ * lines). The buffers get their full size again with the next client. A time
+ * of 0 (default) keeps the buffers.
+ *		void setIdleRelease(uint32_t time, uint16_t floorSize = 0);
  */
 
 #ifndef TelnetSpy_h
@@ -267,12 +538,92 @@
 #define TELNETSPY_PING_TIME 1500
 #define TELNETSPY_PORT 23
 #define TELNETSPY_CAPTURE_OS_PRINT true
+#define TELNETSPY_CHANNEL_OPTION 200 // telnet option number used to mark channel changes
+#define TELNETSPY_CAPTURE_LEN 256 // staging ring per capture source, power of 2
+#define TELNETSPY_CAPTURE_BATCH 32
+#define TELNETSPY_CAPTURE_LOG_LINE 128
+#ifdef ESP8266
+#define TELNETSPY_CAPTURE_SOURCES 1
+#else
+#define TELNETSPY_CAPTURE_SOURCES 2
+#endif
+#define TELNETSPY_OVERFLOW_TIMEOUT 100 // max. ms write() blocks with OVERFLOW_BLOCK
+#define TELNETSPY_REPLAY_MARKS 32 // time index for the replay (see setReplay)
+#define TELNETSPY_EXPORT_CHUNK 256 // copied at once by exportBuffer (on the stack)
+#define TELNETSPY_GOVERNOR_SOURCES (TELNETSPY_CAPTURE_SOURCES + 1)
+#define TELNETSPY_GOVERNOR_SAMPLING 10		// over budget, every n-th line passes
+#define TELNETSPY_GOVERNOR_REPORT 1000		// min. ms between two summaries of suppressed lines
+#define TELNETSPY_GOVERNOR_MAX_RATE 1000000 // bytes per second
+#define TELNETSPY_COLLAPSE_REPORT 1000 // max. ms a run of repeated lines is counted before its summary
 #define TELNETSPY_WELCOME_MSG "Connection established via TelnetSpy.\r\n"
 #define TELNETSPY_REJECT_MSG "TelnetSpy: Only one connection possible.\r\n"
 #define TELNETSPY_REC_BUFFER_LEN 64
+#define TELNETSPY_REC_CHUNK 64
+#define TELNETSPY_ESCAPE_BLOCK 128
+#define TELNETSPY_NEGOTIATION false
+#define TELNETSPY_OOB_LEN 32
+#define TELNETSPY_SB_LEN 8
+#define TELNETSPY_TASK_STACK 4096
+#define TELNETSPY_TASK_PRIORITY 1
+#define TELNETSPY_TASK_PERIOD 10
+#define TELNETSPY_WIFI_CHECK 250
+#define TELNETSPY_HEAP_CHECK 1000	  // ms between two heap checks (adaptive buffer size, failed allocation)
+#define TELNETSPY_HEAP_RESERVE 8192 // free heap the adaptive buffer leaves to the sketch
+#define TELNETSPY_NO_DEADLINE 0xFFFFFFFF
+#define TELNETSPY_CMD_PREFIX 0
+#define TELNETSPY_CMD_LEN 32
+
+#define TELNETSPY_TAGS_LEN 32 // tag allow list of the client ("tags" command)
+#define TELNETSPY_TAG_SCAN 40 // tags must end within this distance from the line start
+#define TELNETSPY_GREP_NODES 64 // max. characters of all grep patterns (max. 255)
+
+// Levels of log lines, as used by the ESP log macros
+#define TELNETSPY_LEVEL_NONE 0 // lines without a recognized level always pass
+#define TELNETSPY_LEVEL_ERROR 1
+#define TELNETSPY_LEVEL_WARN 2
+#define TELNETSPY_LEVEL_INFO 3
+#define TELNETSPY_LEVEL_DEBUG 4
+#define TELNETSPY_LEVEL_VERBOSE 5
 
 #define RLJ_SPY_MODS
 // #define DEBUG_TENETSPY
+// #define TELNETSPY_LATENCY_STATS
+// #define TELNETSPY_TRACE
+// #define TELNETSPY_MCCP
+// #define TELNETSPY_SYSLOG
+// #define TELNETSPY_WEBSOCKET
+
+#ifdef TELNETSPY_LATENCY_STATS
+#define TELNETSPY_LATENCY_STAMPS 16	   // max. number of pending time stamps
+#define TELNETSPY_LATENCY_STAMP_GAP 64 // min. distance (in bytes) between two time stamps
+#define TELNETSPY_LATENCY_BUCKETS 32   // bucket n holds delays up to 2^n - 1 us
+#endif
+
+#ifdef TELNETSPY_MCCP
+#define TELNETSPY_MCCP_WINDOW 2048 // history for matches, power of 2 (max. 32768)
+#define TELNETSPY_MCCP_HASH 1024   // hash table entries, power of 2
+#define TELNETSPY_MCCP_OUT 128	   // output block
+#define TELNETSPY_NVT_OPTIONS 6	   // options handled by the negotiation (with COMPRESS2)
+#else
+#define TELNETSPY_NVT_OPTIONS 5 // options handled by the negotiation
+#endif
+
+#ifdef TELNETSPY_SYSLOG
+#define TELNETSPY_SYSLOG_PORT 514
+#define TELNETSPY_SYSLOG_MTU 1400 // max. size of a datagram (header included)
+#define TELNETSPY_SYSLOG_RATE 100 // max. datagrams (lines) per second
+#define TELNETSPY_SYSLOG_PRI 134  // facility local0, severity informational (for lines without level)
+#endif
+
+#ifdef TELNETSPY_WEBSOCKET
+#define TELNETSPY_WS_FRAME 256 // max. payload of a sent frame (staged on the stack)
+#define TELNETSPY_WS_LINE 48   // handshake header lines are truncated to this length
+#define TELNETSPY_WS_CTRL 125  // payload of received control frames (ping / close)
+#endif
+
+#ifdef TELNETSPY_TRACE
+#define TELNETSPY_TRACE_EVENTS 256 // size of the trace ring (5 bytes per event)
+#endif
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>
@@ -293,6 +644,38 @@
 #define CRITCAL_SECTION_END portEXIT_CRITICAL(&AtomicMutex);
 #endif
 #include <WiFiClient.h>
+#ifdef TELNETSPY_SYSLOG
+#include <WiFiUdp.h>
+#endif
+
+// Base class of additional destinations of the buffered data. Each sink
+// reads the shared buffer at its own pace: handle() calls consume() with new
+// data (in blocks of at least "minSize" bytes, or after "collectingTime").
+class TelnetSpySink
+{
+public:
+	TelnetSpySink();
+	virtual ~TelnetSpySink() {}
+	// Returns the number of bytes taken, the rest is offered again later
+	virtual size_t consume(const char *data, size_t len) = 0;
+	// Data that was removed from the buffer before it could be consumed
+	virtual void lost(uint32_t count) {}
+	void setMinBlockSize(uint16_t minSize);
+	void setCollectingTime(uint16_t colTime);
+	void setLevel(uint8_t maxLevel);
+	uint8_t getLevel();
+
+private:
+	friend class TelnetSpy;
+	TelnetSpySink *nextSink;
+	uint32_t pos; // next byte to consume, counted like "bufWrCount"
+	unsigned long holdoff;
+	uint16_t minBlockSize;
+	uint16_t collectingTime;
+	uint8_t maxLevel;
+	bool lineStart;
+	bool skipLine;
+};
 
 class TelnetSpy : public Stream
 {
@@ -301,7 +684,7 @@ public:
 	~TelnetSpy();
 	bool enabled();
 	void toggle(bool enable);
-	void handle(void);
+	uint32_t handle(void);
 	void setPort(uint16_t portToUse);
 	void setWelcomeMsg(const char *msg);
 	void setWelcomeMsg(const String &msg);
@@ -312,6 +695,13 @@ public:
 	void setMaxBlockSize(uint16_t maxSize);
 	bool setBufferSize(uint16_t newSize);
 	uint16_t getBufferSize();
+	bool setAdaptiveBuffer(uint16_t minSize, uint16_t targetSize, uint16_t maxSize, uint32_t heapReserve = TELNETSPY_HEAP_RESERVE);
+	void setIdleRelease(uint32_t time, uint16_t floorSize = 0);
+	uint16_t getBufferUsed();
+	uint16_t getBufferPending();
+	void setWatermarks(uint16_t high, uint16_t low);
+	bool isBackpressure();
+	void setCallbackOnWatermark(void (*callback)(bool high));
 	void setStoreOffline(bool store);
 	bool getStoreOffline();
 	void setPingTime(uint16_t pngTime);
@@ -323,10 +713,22 @@ public:
 	void setSerial(HardwareSerial *usedSerial);
 #endif
 	bool isClientConnected();
+	void setClientLevel(uint8_t level);
+	uint8_t getClientLevel();
+	void setClientTags(const char *tags);
+	const char *getClientTags();
+	bool setGrep(const char *patterns, uint8_t after = 0);
+	bool addSink(TelnetSpySink &sink, bool history = true);
+	void removeSink(TelnetSpySink &sink);
+	bool addChannel(TelnetSpy &channel, uint8_t id);
+	void removeChannel(TelnetSpy &channel);
+	uint8_t getChannel();
 	void setCallbackOnConnect(void (*callback)());
 	void setCallbackOnDisconnect(void (*callback)());
 	void disconnectClient();
 	void clearBuffer();
+	size_t exportBuffer(Print &out);
+	void setReplay(uint16_t lines, uint16_t seconds = 0);
 	void setFilter(char ch, const char *msg, void (*callback)());
 	void setFilter(char ch, const String &msg, void (*callback)());
 	char getFilter();
@@ -338,6 +740,45 @@ public:
 	void setCallbackOnNvtEL(void (*callback)());
 	void setCallbackOnNvtGA(void (*callback)());
 	void setCallbackOnNvtWWDD(void (*callback)(char command, char option));
+#ifndef ESP8266
+	bool startTask(BaseType_t core = tskNO_AFFINITY);
+	void stopTask();
+	bool isTaskRunning();
+	void taskLoop();
+#endif
+	void setCommandPrefix(char ch);
+	char getCommandPrefix();
+	void setBinarySafe(bool enable);
+	bool getBinarySafe();
+	void setNegotiation(bool enable);
+	bool getNegotiation();
+	uint16_t getWindowWidth();
+	uint16_t getWindowHeight();
+#ifdef TELNETSPY_MCCP
+	bool setCompression(bool enable);
+	bool getCompression();
+	bool isCompressing();
+#endif
+#ifdef TELNETSPY_WEBSOCKET
+	void setWebSocket(bool enable);
+	bool getWebSocket();
+#endif
+#ifdef TELNETSPY_SYSLOG
+	bool setSyslog(IPAddress collector, uint16_t port = TELNETSPY_SYSLOG_PORT, const char *hostname = NULL, const char *appName = "TelnetSpy");
+	void stopSyslog();
+	bool isSyslogActive();
+	void setSyslogRate(uint16_t datagramsPerSecond);
+#endif
+#ifdef TELNETSPY_LATENCY_STATS
+	uint32_t getLatencyPercentile(uint8_t percent);
+	uint32_t getLatencyMax();
+	uint32_t getLatencyCount();
+	void resetLatencyStats();
+#endif
+#ifdef TELNETSPY_TRACE
+	void exportTrace(Print &out);
+	void clearTrace();
+#endif
 	// Functions offered by HardwareSerial class:
 #ifdef ESP8266
 	void begin(unsigned long baud)
@@ -365,28 +806,223 @@ public:
 	int available(void) override;
 	int peek(void) override;
 	int read(void) override;
+	int read(uint8_t *buffer, size_t size);
+	inline int read(char *buffer, size_t size) { return read((uint8_t *)buffer, size); }
+	size_t readBytes(char *buffer, size_t length) override;
+	size_t readBytesUntil(char terminator, char *buffer, size_t length);
+	inline size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length) { return readBytesUntil(terminator, (char *)buffer, length); }
+	using Stream::readBytes;
 	int availableForWrite(void);
 	void flush(void) override;
 	void debugWrite(uint8_t);
 	size_t write(uint8_t) override;
+	uint16_t reserve(uint16_t len, char *&data1, uint16_t &len1, char *&data2, uint16_t &len2);
+	void commit(uint16_t len);
 	inline size_t write(unsigned long n) { return write((uint8_t)n); }
 	inline size_t write(long n) { return write((uint8_t)n); }
 	inline size_t write(unsigned int n) { return write((uint8_t)n); }
 	inline size_t write(int n) { return write((uint8_t)n); }
 	using Print::write;
+	enum overflowPolicy
+	{
+		OVERFLOW_DROP_OLDEST, // remove the oldest line
+		OVERFLOW_DROP_NEWEST, // remove sent lines only, else drop the new line
+		OVERFLOW_BLOCK		  // send until the oldest line is sent (or timeout)
+	};
+	void setOverflowPolicy(overflowPolicy policy, uint16_t timeout = TELNETSPY_OVERFLOW_TIMEOUT);
+	overflowPolicy getOverflowPolicy();
+	size_t write(const uint8_t *buffer, size_t size, overflowPolicy policy);
+	void setCollapse(bool enable);
+	bool getCollapse();
 	operator bool() const;
 	void setDebugOutput(bool);
+	enum captureSource
+	{
+		CAPTURE_OS_PRINT, // os_printf / ets_putc
+#ifndef ESP8266
+		CAPTURE_ESP_LOG, // ESP_LOGx of the IDF
+#endif
+	};
+	void setCapture(captureSource source, bool enable);
+	bool getCapture(captureSource source);
+	void drainCapture(void);
+	enum governorSource
+	{
+		GOVERN_WRITE,	 // write(), print(), ... of the sketch
+		GOVERN_OS_PRINT, // see CAPTURE_OS_PRINT
+#ifndef ESP8266
+		GOVERN_ESP_LOG, // see CAPTURE_ESP_LOG
+#endif
+	};
+	bool setGovernor(governorSource source, uint32_t bytesPerSecond, uint16_t linesPerSecond, uint16_t sampling = TELNETSPY_GOVERNOR_SAMPLING);
+	uint32_t getSuppressed(governorSource source);
 	uint32_t baudRate(void);
 
 protected:
 	CRITCAL_SECTION_MUTEX
 	void sendBlock(void);
+	void storeDebug(const char *data, size_t len, uint8_t source);
+	bool governByte(uint8_t source, char c);
+	uint32_t governorReport();
+	void checkWatermarks();
+	uint32_t adaptBuffer();
+	bool resizeBuffer(uint16_t newSize);
+	bool needBuffer();
+	void allocBuffers();
+	uint32_t releaseIdle();
+	uint32_t housekeeping();
+	uint16_t bufSize; // configured size, "telnetBuf" is allocated on demand
+	unsigned long allocHoldoff; // no new attempt after all sizes failed
+	uint16_t recSize;
+	uint32_t idleTime; // 0: the buffers are kept
+	uint16_t idleFloor;
+	unsigned long idleHoldoff;
+	uint16_t adaptMin; // 0: adaptive buffer size disabled
+	uint16_t adaptTarget;
+	uint16_t adaptMax;
+	uint32_t adaptReserve;
+	unsigned long adaptHoldoff;
+	uint16_t watermarkHigh;
+	uint16_t watermarkLow;
+	bool backpressure;
+	void (*callbackWatermark)(bool high);
+	struct TelnetSpyGovernor *governors;
+	unsigned long governorHoldoff;
+	volatile bool governorDue; // a summary should be stored before the next line
+	uint32_t feedSink(TelnetSpySink *sink);
+	int lineLevel(uint32_t linePos, bool force, char *tag = NULL, uint8_t tagSize = 0);
+	inline bool isClientFiltered() { return (clientLevel < TELNETSPY_LEVEL_VERBOSE) || clientTags[0] || grep; }
+	uint16_t filterRun(uint16_t idx, uint16_t len, bool &skip);
+	bool isTagAllowed(const char *tag);
+	int skipLine(uint32_t linePos, bool force);
+	int grepLine(uint32_t linePos, bool force);
+	struct TelnetSpyGrep *grep;
+	uint8_t grepAfter;
+	uint8_t grepContextLeft;
+	uint8_t clientLevel;
+	char clientTags[TELNETSPY_TAGS_LEN];
+	bool sendLineStart; // the send cursor is at the start of a line
+	bool sendSkipLine;	// the line at the send cursor is filtered
+	bool sendCut;		// the rest of a partly sent line was evicted
+	TelnetSpySink *sinks;
+	uint32_t bufWrCount; // all bytes ever stored
+	uint16_t bufReserved; // reserved by reserve(), behind bufWrIdx
+	enum dropState
+	{
+		STORE_LINE,
+		STORE_CUT, // the line end of a cut line is stored first
+		DROP_LINE,
+		DROP_CUT // the start of the line was stored already
+	};
+	bool dropByte(uint8_t &state, char c, bool mayBlock);
+	bool makeRoom(bool mayBlock);
+	bool isOldestLineSent();
+	overflowPolicy overflow;
+	uint16_t overflowTimeout;
+	uint8_t writeDrop;	 // dropState of write()
+	void storeByte(char c);
+	void collapseByte(char c);
+	uint32_t collapseFlush(bool force);
+	bool collapse;
+	bool collapseLineStart;
+	bool collapseComparing;	  // the line is the same as the line before so far
+	uint16_t collapseHeld;	  // bytes of the line not stored yet (the same as of the line before)
+	uint32_t collapseLinePos; // start of the line, counted like "bufWrCount"
+	uint32_t collapsePrevPos;
+	uint16_t collapsePrevLen;
+	uint32_t collapseRepeats;
+	unsigned long collapseHoldoff;
+	unsigned long collapseRunHoldoff; // armed when a run of repeats starts
+	uint32_t collapseWrCount; // "bufWrCount" after our last byte, else others stored data
+	bool collapseMixed;		  // the line holds data of others
+	uint8_t captureDrop; // dropState of the captured system output
+	void selectChannel(uint8_t id);
+	void replayBuffer(void);
+	void replayWindow(uint16_t lines, uint16_t seconds);
+	void markLine();
+	uint16_t replayLines;
+	uint16_t replaySeconds;
+	struct TelnetSpyReplayMarks *replayMarks;
+	bool bufLastNewline; // the last stored byte ends a line
+	TelnetSpy *channelHost; // the instance sending our data, if we are a channel
+	TelnetSpy *channels;	// channels sent via our connection
+	TelnetSpy *nextChannel;
+	uint8_t channelId;
+	uint8_t activeChannel; // channel of the data sent last
+	void writeClient(const uint8_t *data, size_t len);
+	// the connection our data goes to (a channel's data is sent by its host)
+	inline bool isOnline() { return channelHost ? channelHost->client.connected() : client.connected(); }
+	void transmit(const uint8_t *data, size_t len);
+#ifdef TELNETSPY_WEBSOCKET
+	inline bool isWebSocketClient() { return wsState != WS_OFF; }
+	enum wsStates
+	{
+		WS_OFF,		  // telnet client
+		WS_HANDSHAKE, // waiting for the HTTP upgrade request
+		WS_OPEN
+	};
+	void wsReceive(uint8_t c);
+	void wsHandshakeLine();
+	void wsFrameDone();
+	void wsFrame(uint8_t opcode, const uint8_t *data, size_t len);
+	bool webSocket;
+	uint8_t wsState;
+	char wsLine[TELNETSPY_WS_LINE];
+	uint8_t wsLineLen;
+	char wsKey[25];
+	uint8_t wsHeaders; // WS_HDR_x seen in the handshake request
+	uint8_t wsRxHeader[14];
+	uint8_t wsRxHeaderLen;
+	uint32_t wsRxLeft;
+	uint8_t wsRxMaskIdx;
+	uint8_t wsCtrl[TELNETSPY_WS_CTRL];
+	uint8_t wsCtrlLen;
+#else
+	inline bool isWebSocketClient() { return false; }
+#endif
+	enum taskRequest
+	{
+		TASK_DISCONNECT = 1, // disconnectClient()
+		TASK_SET_PORT = 2,	 // setPort()
+		TASK_DISABLE = 4	 // toggle(false)
+	};
+#ifdef ESP8266
+	inline bool taskOwnsClient() { return false; }
+	inline bool passToTask(uint8_t request) { return false; }
+#else
+	// true if the background task handles the connection, but we are called from elsewhere
+	inline bool taskOwnsClient()
+	{
+		TaskHandle_t task = taskHandle; // read once, the task clears it when it ends
+		return task && (xTaskGetCurrentTaskHandle() != task);
+	}
+	void notifyTask();
+	bool passToTask(uint8_t request);
+	void doTaskRequests();
+	TaskHandle_t taskHandle;
+	volatile bool taskStop;
+	volatile uint8_t taskRequests; // taskRequest bits, done by the next handle()
+#endif
+	bool queueOob(const uint8_t *data, uint8_t len);
+	bool sendOob();
+	void startNegotiation();
+	void requestOption(uint8_t cmd, uint8_t option);
+	void negotiate(uint8_t cmd, uint8_t option);
+	void handleSubnegotiation();
+	int nvtOptionIndex(uint8_t option);
+	bool nvtAccept(uint8_t option, bool local);
+	void queueNvt(uint8_t cmd, uint8_t option);
 	void addTelnetBuf(char c);
 	char pullTelnetBuf();
 	char peekTelnetBuf();
 	int telnetAvailable();
 	void writeRecBuf(char c);
+	size_t pullRecBuf(uint8_t *buffer, size_t size, int terminator, bool &found);
+	void receiveChar(char c);
+	void parseReceived(uint8_t c);
 	void checkReceive();
+	void handleCommand();
+	void sendReply(const char *msg);
 	WiFiServer *telnetServer;
 	WiFiClient client;
 	uint16_t port;
@@ -404,24 +1040,109 @@ protected:
 	void removeOldestLine(void);
 	void setHoldoff(unsigned long &holdoff, unsigned long period);
 	bool isHoldoff(unsigned long &holdoff);
+	uint32_t holdoffLeft(unsigned long &holdoff);
 	unsigned long waitHoldoff;
 	unsigned long pingHoldoff;
+	unsigned long wifiHoldoff;
 	// additions to allow FULL recall EVERY time telnet re-connects
 	uint16_t bufRdIdxStart;
 	uint16_t bufLeftToSend;
-	uint8_t NVT[2];
-	uint8_t NVTidx;
 #else
 	unsigned long waitRef;
 	unsigned long pingRef;
 #endif
 	uint16_t pingTime;
 	bool nvtDetected;
+	bool binarySafe;
+	enum nvtParserState
+	{
+		NVT_DATA,
+		NVT_IAC,
+		NVT_OPTION,
+		NVT_SB,
+		NVT_SB_IAC
+	};
+	uint8_t nvtState;
+	uint8_t nvtCmd;
+	bool negotiation;
+	enum nvtOptionState
+	{
+		NVT_OPT_US = 1,			// option enabled on our side
+		NVT_OPT_US_PENDING = 2,	// we asked to change our side
+		NVT_OPT_HIM = 4,		// option enabled on the client side
+		NVT_OPT_HIM_PENDING = 8 // we asked the client to change its side
+	};
+	uint8_t nvtOpt[TELNETSPY_NVT_OPTIONS];
+	uint8_t sbBuf[TELNETSPY_SB_LEN];
+	uint8_t sbLen;
+	uint16_t windowWidth;
+	uint16_t windowHeight;
+	uint8_t oobBuf[TELNETSPY_OOB_LEN]; // out of band data (pings, negotiation) sent before the buffer data
+	uint8_t oobUsed;
+#ifdef TELNETSPY_MCCP
+	void startCompression();
+	void stopCompression();
+	void deflateData(const uint8_t *data, size_t len);
+	void deflateMatch(uint16_t len, uint16_t dist);
+	void deflateSymbol(uint16_t sym);
+	void deflateCode(uint16_t code, uint8_t count);
+	void deflateBits(uint32_t value, uint8_t count);
+	struct TelnetSpyDeflate *mccp;
+	bool mccpActive;
+#endif
+#ifdef TELNETSPY_SYSLOG
+	uint32_t sendSyslog();
+	WiFiUDP *syslogUdp;
+	IPAddress syslogIP;
+	uint16_t syslogPort;
+	char *syslogHeader;
+	uint16_t syslogInterval;
+	unsigned long syslogHoldoff;
+	unsigned long syslogLineHoldoff;
+	bool syslogLineWait; // only an incomplete line is left, waiting for its end
+	uint16_t sysRdIdx;
+	uint16_t sysLeftToSend;
+#endif
 	char *welcomeMsg;
 	char *rejectMsg;
 	char filterChar;
 	char *filterMsg;
 	void (*filterCallback)();
+	char cmdPrefix;
+	char cmdLine[TELNETSPY_CMD_LEN];
+	uint8_t cmdLen;
+	uint8_t cmdState; // 0: idle, 1: collecting command, 2: command line end
+	bool recLineStart;
+#ifdef TELNETSPY_LATENCY_STATS
+	void stampLatency();
+	void recordLatency();
+	void clearLatencyStamps();
+	uint32_t latStampPos[TELNETSPY_LATENCY_STAMPS];
+	uint32_t latStampTime[TELNETSPY_LATENCY_STAMPS];
+	uint8_t latStampRdIdx;
+	uint8_t latStampUsed;
+	uint32_t latHist[TELNETSPY_LATENCY_BUCKETS];
+	uint32_t latCount;
+	uint32_t latMax;
+#endif
+	friend class TelnetSpyClientPrint;
+#ifdef TELNETSPY_TRACE
+	friend class TelnetSpyTraceScope;
+	enum tracePhase
+	{
+		TRACE_HANDLE,
+		TRACE_SEND,
+		TRACE_RECEIVE,
+		TRACE_CONNECT,
+		TRACE_EVICT
+	};
+	void traceEvent(uint8_t phase, bool begin);
+	uint32_t traceTime[TELNETSPY_TRACE_EVENTS];
+	uint8_t traceType[TELNETSPY_TRACE_EVENTS]; // phase, bit 7 set for "begin"
+	uint16_t traceWrIdx;
+	uint16_t traceUsed;
+	bool tracePaused;
+#endif
 	uint16_t minBlockSize;
 	uint16_t collectingTime;
 	uint16_t maxBlockSize;